@@ -0,0 +1,70 @@
+/*
+ * The interface between the interpreter and native extensions, which are
+ * shared objects loaded with "load-extension <file>".
+ *
+ * An extension exports iforth_extension_abi, set to IFORTH_ABI_VERSION,
+ * and iforth_extension_init, which is called once when the extension is
+ * loaded and adds its words with api->add_word. Extensions built against a
+ * different ABI version are refused.
+ *
+ * Errors stop the program unless it is inside 'catch'. Then they can't
+ * unwind through the extension, so the api functions return instead: the
+ * failing call and any later ones in the same word return 0 (or NULL) and
+ * do nothing, and the error is raised once the word returns. Words should
+ * return as soon as error has been called or mem returns NULL.
+ */
+#ifndef IFORTH_EXTENSION_H
+#define IFORTH_EXTENSION_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define IFORTH_ABI_VERSION 2
+
+typedef int64_t iforth_cell;
+
+/* The machine running the word. Only used through the api functions. */
+typedef struct iforth_vm iforth_vm;
+
+typedef void (*iforth_word_fn)(iforth_vm *vm);
+
+typedef struct iforth_api {
+  uint32_t abi_version;
+
+  /*
+   * Data stack access. pop reports an error on an empty stack and returns
+   * 0 if it returns.
+   */
+  iforth_cell (*pop)(iforth_vm *vm);
+  void (*push)(iforth_vm *vm, iforth_cell value);
+
+  /*
+   * Translates len bytes of the machine's memory at addr to a host
+   * pointer, reporting an error and returning NULL if they aren't all
+   * readable (or writable, if write is nonzero).
+   */
+  char *(*mem)(iforth_vm *vm, iforth_cell addr, iforth_cell len, int write);
+
+  /* Reports an error, which stops the program or returns to 'catch'. */
+  void (*error)(iforth_vm *vm, const char *message);
+
+  /*
+   * Adds a word that calls fn. Returns 0 on success or -1 if no more
+   * extension words can be added.
+   */
+  int (*add_word)(iforth_vm *vm, const char *name, iforth_word_fn fn);
+} iforth_api;
+
+extern const uint32_t iforth_extension_abi;
+
+/* Returns 0 on success. */
+int iforth_extension_init(iforth_vm *vm, const iforth_api *api);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
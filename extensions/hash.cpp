@@ -0,0 +1,131 @@
+/*
+ * An example extension adding a fast hash of a block of memory:
+ *
+ *   load-extension extensions/hash.so
+ *   s" some text" hash .
+ *
+ * hash processes 16 bytes at a time in two 64-bit lanes, using SSE2 where
+ * available. hash-scalar computes the same value one lane at a time.
+ */
+#include <cstring>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "extension.h"
+
+namespace {
+
+const iforth_api *api;
+
+const uint64_t key[2] = { 0x9e3779b97f4a7c15ull, 0xc2b2ae3d27d4eb4full };
+
+uint64_t finish(const uint64_t acc[2])
+{
+  auto h = acc[0] ^ ((acc[1] << 29) | (acc[1] >> 35));
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdull;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ull;
+  h ^= h >> 33;
+  return h;
+}
+
+/*
+ * Each 16-byte block adds the product of the halves of each lane, after
+ * mixing in the key, and the other lane's data to the lane's accumulator.
+ */
+void scalarBlock(uint64_t acc[2], const char *p)
+{
+  uint64_t d[2];
+  memcpy(d, p, sizeof(d));
+  for (int i = 0; i < 2; ++i) {
+    auto x = d[i] ^ key[i];
+    acc[i] += (x & 0xffffffff) * (x >> 32) + d[1 - i];
+  }
+}
+
+uint64_t hashScalar(const char *p, uint64_t len)
+{
+  uint64_t acc[2] = { len ^ key[0], len ^ key[1] };
+  auto end = p + len - len % 16;
+  for (; p != end; p += 16) {
+    scalarBlock(acc, p);
+  }
+  if (len % 16) {
+    char tail[16] = { };
+    memcpy(tail, p, len % 16);
+    scalarBlock(acc, tail);
+  }
+  return finish(acc);
+}
+
+#ifdef __SSE2__
+uint64_t hashSimd(const char *p, uint64_t len)
+{
+  auto k = _mm_set_epi64x(key[1], key[0]);
+  auto acc = _mm_set_epi64x(len ^ key[1], len ^ key[0]);
+  auto block = [&](const char *q) {
+    auto d = _mm_loadu_si128((const __m128i*)q);
+    auto x = _mm_xor_si128(d, k);
+    auto prod = _mm_mul_epu32(x, _mm_srli_epi64(x, 32));
+    auto swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+    acc = _mm_add_epi64(acc, _mm_add_epi64(prod, swapped));
+  };
+  auto end = p + len - len % 16;
+  for (; p != end; p += 16) {
+    block(p);
+  }
+  if (len % 16) {
+    char tail[16] = { };
+    memcpy(tail, p, len % 16);
+    block(tail);
+  }
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*)lanes, acc);
+  return finish(lanes);
+}
+#else
+uint64_t hashSimd(const char *p, uint64_t len)
+{
+  return hashScalar(p, len);
+}
+#endif
+
+/*
+ * ( addr len -- h )
+ */
+template<uint64_t (*hash)(const char*, uint64_t)>
+void hashWord(iforth_vm *vm)
+{
+  auto len = api->pop(vm);
+  auto addr = api->pop(vm);
+  if (len < 0) {
+    api->error(vm, "negative length");
+    return;
+  }
+  auto p = api->mem(vm, addr, len, 0);
+  if (!p) {
+    return;
+  }
+  api->push(vm, (iforth_cell)hash(p, len));
+}
+
+}
+
+extern "C" {
+
+const uint32_t iforth_extension_abi = IFORTH_ABI_VERSION;
+
+int iforth_extension_init(iforth_vm *vm, const iforth_api *api_)
+{
+  api = api_;
+  if (api->add_word(vm, "hash", &hashWord<hashSimd>) ||
+      api->add_word(vm, "hash-scalar", &hashWord<hashScalar>)) {
+    return -1;
+  }
+  return 0;
+}
+
+}
@@ -3,13 +3,40 @@ const char *forth = R"(
 )";
 /* ==== interpreter implementation ==== */
 #include <cctype>
+#include <array>
+#include <cerrno>
+#include <cstdint>
 #include <cstdlib>
+#include <condition_variable>
+#include <cstddef>
+#include <cstring>
 #include <functional>
 #include <iostream>
 #include <fstream>
+#include <limits>
+#include <memory>
+#include <mutex>
 #include <regex>
+#include <set>
 #include <string>
+#include <thread>
+#include <type_traits>
+#include <unordered_map>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "extension.h"
 
 enum class tokens {
   start_definition,
@@ -18,9 +45,12 @@ enum class tokens {
   identifier,
   number,
   string,
+  counted_string,
   label,
   comment,
-  last_token = comment,
+  table,
+  operation,
+  last_token = operation,
 };
 using token_kind = tokens;
 constexpr size_t num_token_kinds = (size_t)tokens::last_token + 1;
@@ -29,9 +59,121 @@ struct machine_state;
 struct token;
 class token_opt;
 
+/*
+ * Thrown instead of exiting when an error occurs while the optimizer is
+ * speculatively running code at compile time.
+ */
+struct speculation_failed { };
+
+/*
+ * A bump allocator for everything that lives as long as a program: its
+ * tokens, labels and symbols. Memory comes from large chunks and is only
+ * given back all at once, when the arena is destroyed.
+ */
+class arena
+{
+public:
+  static constexpr size_t chunk_size = 1 << 20;
+
+  arena() = default;
+  arena(const arena&) = delete;
+  arena& operator=(const arena&) = delete;
+
+  void *allocate(size_t size, size_t align)
+  {
+    auto at = (used + align - 1) & ~(align - 1);
+    if (chunks.empty() || at + size > chunk_end) {
+      // Allocations too big for a chunk get one of their own.
+      chunk_end = size > chunk_size ? size : chunk_size;
+      chunks.emplace_back(new char[chunk_end]);
+      at = 0;
+    }
+    used = at + size;
+    allocated += size;
+    return chunks.back().get() + at;
+  }
+
+  size_t bytes_allocated() const { return allocated; }
+
+private:
+  std::vector<std::unique_ptr<char[]>> chunks;
+  size_t chunk_end = 0;
+  size_t used = 0;
+  size_t allocated = 0;
+};
+
+/*
+ * Allocates a container's memory from an arena. Freeing does nothing; the
+ * memory is reclaimed with the arena.
+ */
+template<class T>
+struct arena_allocator
+{
+  using value_type = T;
+
+  arena_allocator(arena& a) : a { &a } { }
+  template<class U>
+  arena_allocator(const arena_allocator<U>& other) : a { other.a } { }
+
+  T *allocate(size_t n)
+  {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "overaligned");
+    return (T*)a->allocate(n * sizeof(T), alignof(T));
+  }
+
+  void deallocate(T*, size_t) { }
+
+  template<class U>
+  bool operator==(const arena_allocator<U>& other) const
+  {
+    return a == other.a;
+  }
+
+  template<class U>
+  bool operator!=(const arena_allocator<U>& other) const
+  {
+    return a != other.a;
+  }
+
+  arena *a;
+};
+
 using interp_fn = std::function<void(machine_state&, const token&)>;
 using lex_fn = std::function<token_opt(const char*, const char*)>;
-using token_iterator = std::vector<token>::const_iterator;
+using token_vector = std::vector<token, arena_allocator<token>>;
+using token_iterator = token_vector::const_iterator;
+using label_map = std::map<
+  std::string, token_iterator, std::less<std::string>,
+  arena_allocator<std::pair<const std::string, token_iterator>>>;
+
+/*
+ * The type of values on the stacks and in memory.
+ */
+using cell = std::int64_t;
+
+/*
+ * Standard throw codes for the errors a program can catch. Other errors
+ * throw throw_other, the first code reserved for the implementation.
+ */
+enum throw_code : cell
+{
+  throw_stack_underflow = -4,
+  throw_rstack_underflow = -6,
+  throw_invalid_address = -9,
+  throw_division_by_zero = -10,
+  throw_out_of_range = -11,
+  throw_undefined_word = -13,
+  throw_other = -256,
+};
+
+/*
+ * Thrown by 'throw', and instead of exiting when an error occurs, while a
+ * 'catch' is running.
+ */
+struct forth_exception
+{
+  cell code;
+};
 
 /*
  * Represents a lexed token from the input stream.
@@ -108,7 +250,8 @@ lex_fn lexRegex(
   ](const char *begin, const char *end) -> token_opt
   {
     std::cmatch m;
-    if (std::regex_search(begin, end, m, re)) {
+    if (std::regex_search(
+          begin, end, m, re, std::regex_constants::match_continuous)) {
       return token { kind, begin, begin + m.length(), interp };
     }
     return token_opt { };
@@ -118,7 +261,7 @@ lex_fn lexRegex(
 std::string toLower(std::string s)
 {
   std::transform(
-    s.begin(), s.end(), s.end(),
+    s.begin(), s.end(), s.begin(),
     [](unsigned char c) -> unsigned char
     {
       if (c >= 'A' && c <= 'Z') return c - ('A' - 'a');
@@ -137,717 +280,5753 @@ bool isTokenWithId(const std::string& id, const token& tok)
   return toLower(tok.to_string()) == id;
 }
 
+/*
+ * True for words that read the token after them instead of letting it be
+ * interpreted.
+ */
+bool parsesOperand(const token& tok)
+{
+  return isTokenWithId("'", tok) ||
+         isTokenWithId("load-extension", tok) ||
+         isTokenWithId("branch", tok) ||
+         isTokenWithId("?branch", tok) ||
+         isTokenWithId("postpone", tok) ||
+         isTokenWithId("[char]", tok);
+}
 
-struct machine_state
+
+using ucell = std::make_unsigned<cell>::type;
+
+/*
+ * Writes the digits of v in the given base so that they end just before
+ * end, two digits at a time where there is a table for the base. Returns a
+ * pointer to the first digit.
+ */
+char *formatUnsigned(char *end, ucell v, unsigned base)
 {
-  machine_state(std::vector<token> tokens) :
-    token_stream { std::move(tokens) },
-    curr_token { token_stream.begin() }
+  static const char digits[] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ";
+  static const struct pair_table
   {
-    for (auto it = token_stream.begin(); it != token_stream.end(); ++it) {
-      if (it->kind != tokens::label) continue;
+    pair_table(unsigned base)
+    {
+      for (unsigned i = 0; i < base * base; ++i) {
+        pairs[2 * i] = digits[i / base];
+        pairs[2 * i + 1] = digits[i % base];
+      }
+    }
+    char pairs[2 * 16 * 16];
+  } decimal_pairs { 10 }, hex_pairs { 16 };
 
-      labels[std::string { it->start + 1, it->end - 1 }] = it;
+  auto p = end;
+  if (base == 10 || base == 16) {
+    auto pairs = (base == 10 ? decimal_pairs : hex_pairs).pairs;
+    auto square = base * base;
+    while (v >= square) {
+      auto idx = 2 * (v % square);
+      v /= square;
+      *--p = pairs[idx + 1];
+      *--p = pairs[idx];
     }
+    if (v >= base) {
+      *--p = pairs[2 * v + 1];
+      *--p = pairs[2 * v];
+    } else {
+      *--p = digits[v];
+    }
+    return p;
   }
 
-  void push(int n)
+  do {
+    *--p = digits[v % base];
+    v /= base;
+  } while (v);
+  return p;
+}
+
+/*
+ * Buffers standard output. Everything the program prints goes through here
+ * rather than through iostreams, so numbers are formatted straight into the
+ * buffer and there is one write(2) per buffer full. When stdout is a
+ * terminal, the buffer is also flushed at the end of each line.
+ */
+struct output_buffer
+{
+  output_buffer(int fd) : fd { fd }, line_buffered { isatty(fd) != 0 } { }
+
+  ~output_buffer()
   {
-    dstack.push_back(n);
+    flush();
   }
 
-  static void print_stack(std::ostream& out, const std::deque<int>& s)
+  void put(char c)
   {
-    out << "[";
-    for (size_t i = 0; i < s.size(); ++i) {
-      auto idx = s.size() - i - 1;
-      out << idx << ":" << s[i] << (idx == 0 ? "" : " ");
+    if (used == sizeof(data)) {
+      flush();
+    }
+    data[used++] = c;
+    if (c == '\n' && line_buffered) {
+      flush();
     }
-    out << "]\n";
   }
 
-  void debug(std::ostream& out) const
+  void write(const char *p, size_t n)
   {
-    out << "========= machine state =========\n";
-    out << "token stream:\n";
-    for (auto i = 0; i < (int)token_stream.size(); ++i) {
-      out << i << ":[" << token_stream[i] << "] ";
+    for (; n; --n) {
+      put(*p++);
     }
-    out << "\n\ndata stack:\n";
-    print_stack(out, dstack);
-    out << "\nreturn stack:\n";
-    print_stack(out, rstack);
-    out << "\nip: " << ip() << " "
-        << (atEnd() ? std::string { "\n"}
-                    : ("(" + curr_token->to_string() + ")\n"));
-    out << "=================================";
-    out << std::endl;
   }
 
-  struct error_state
+  void write(const std::string& s)
   {
-    error_state() : m { nullptr } { }
-    error_state(const machine_state& m) : m { &m } { }
-    error_state(error_state&& es) :
-      m { es.m }, ss { std::move(es.ss) }
-    {
-      es.m = nullptr;
+    write(s.data(), s.size());
+  }
+
+  /*
+   * Prints n in the given base, right-aligned in a field of the given
+   * width.
+   */
+  void number(cell n, unsigned base, size_t width = 0, bool is_signed = true)
+  {
+    char buf[8 * sizeof(cell) + 1];
+    auto end = buf + sizeof(buf);
+    auto neg = is_signed && n < 0;
+    auto p = formatUnsigned(end, neg ? -(ucell)n : (ucell)n, base);
+    if (neg) {
+      *--p = '-';
     }
-    ~error_state() {
-      if (m) {
-        ss << "\n";
-        m->debug(ss);
-        std::cerr << ss.str() << std::endl;
-        ::exit(1);
+    for (auto len = (size_t)(end - p); len < width; ++len) {
+      put(' ');
+    }
+    if (sizeof(data) - used < (size_t)(end - p)) {
+      flush();
+    }
+    memcpy(data + used, p, end - p);
+    used += end - p;
+  }
+
+  void flush()
+  {
+    for (size_t off = 0; off < used; ) {
+      auto n = ::write(fd, data + off, used - off);
+      if (n < 0) {
+        break;
       }
+      off += n;
     }
+    written += used;
+    used = 0;
+  }
 
-    const machine_state *m;
-    std::stringstream ss;
+  int fd;
+  bool line_buffered;
+  size_t used = 0;
+  size_t written = 0;
+  char data[1 << 16];
+};
 
-    template<class T>
-    error_state& operator<<(T&& op)
-    {
-      ss << std::forward<T&&>(op);
-      return *this;
-    }
+output_buffer output { 1 };
 
-    error_state& operator<<(std::basic_ostream<char>& (*fn)(std::basic_ostream<char>&)) {
-      ss << fn;
-      return *this;
-    }
-  };
+/*
+ * Buffered reader over a file descriptor. Lines are found with memchr and
+ * returned as pointers into the buffer, which stay valid until the next
+ * read.
+ */
+struct input_buffer
+{
+  input_buffer(int fd, size_t max_size = SIZE_MAX) :
+    fd { fd }, max_size { max_size }, data(1 << 20)
+  { }
 
-  error_state error() const
+  /*
+   * Reads more data, first moving unread data to the front of the buffer
+   * and growing the buffer, up to max_size, if it's full. Returns false at
+   * end of file, or with overflowed set if the buffer can't grow.
+   */
+  bool fill()
   {
-    error_state es { *this };
-    es << "error interpreting token " << *curr_token << ": ";
-    return es;
+    if (start) {
+      memmove(data.data(), data.data() + start, end - start);
+      end -= start;
+      start = 0;
+    }
+    if (end == data.size()) {
+      if (data.size() >= max_size) {
+        overflowed = true;
+        return false;
+      }
+      data.resize(std::min(2 * data.size(), max_size));
+    }
+    if (output.line_buffered) {
+      output.flush();
+    }
+    ssize_t n;
+    do {
+      n = ::read(fd, data.data() + end, data.size() - end);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0) {
+      return false;
+    }
+    end += n;
+    return true;
   }
 
-  error_state assert(bool val) const
+  /*
+   * Returns the next byte of input, or -1 at end of file.
+   */
+  int key()
   {
-    if (!val) {
-      error_state es { *this };
-      es << "assertion while interpreting token " << *curr_token << ": ";
-      return es;
+    if (start == end && !fill()) {
+      return -1;
     }
-    return error_state { };
+    return (unsigned char)data[start++];
   }
 
-  int pop()
+  /*
+   * Finds the next line, without its line terminator. Lines longer than max
+   * are split, with the rest returned by the next call. Returns false at end
+   * of file.
+   */
+  bool line(const char *&p, size_t& n, size_t max = SIZE_MAX)
   {
-    if (dstack.empty()) {
-      error() << "tried to pop from empty stack";
+    size_t scanned = 0;
+    const char *nl;
+    while (!(nl = (const char*)memchr(
+               data.data() + start + scanned, '\n', end - start - scanned))) {
+      if (end - start >= max) {
+        break;
+      }
+      scanned = end - start;
+      if (!fill()) {
+        if (start == end) {
+          return false;
+        }
+        break;
+      }
     }
-    auto result = dstack.back();
-    dstack.pop_back();
-    return result;
+
+    p = data.data() + start;
+    n = nl ? nl - p : end - start;
+    if (n > max) {
+      n = max;
+      nl = nullptr;
+    }
+    start += n + (nl ? 1 : 0);
+    if (nl && n && p[n - 1] == '\r') {
+      --n;
+    }
+    return true;
+  }
+
+  int fd;
+  size_t max_size;
+  std::vector<char> data;
+  size_t start = 0;
+  size_t end = 0;
+  bool overflowed = false;
+};
+
+/*
+ * Standard Forth I/O result codes.
+ */
+enum ior : cell {
+  ior_ok = 0,
+  ior_file_io = -37,
+  ior_no_file = -38,
+};
+
+constexpr bool isLittleEndian()
+{
+  return __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+}
+
+template<class T>
+T fromLittleEndian(T v)
+{
+  if (isLittleEndian()) {
+    return v;
   }
+  return sizeof(T) == 4 ? __builtin_bswap32(v) : __builtin_bswap64(v);
+}
+
+cell iorFromErrno()
+{
+  return errno == ENOENT ? ior_no_file : ior_file_io;
+}
+
+/*
+ * An open file. Reads and writes each have their own buffer; transfers of
+ * at least direct_io bytes bypass the buffers and go straight between the
+ * file and the machine's memory.
+ */
+struct file
+{
+  static constexpr size_t direct_io = 1 << 16;
+
+  file(int fd, int fam) :
+    fd { fd }, writable { (fam & O_ACCMODE) != O_RDONLY }, in { fd }
+  { }
 
-  bool pop(int& out)
+  ~file()
   {
-    if (dstack.empty()) {
-      return false;
+    close();
+  }
+
+  /*
+   * Reads up to n bytes into dest, stopping early only at end of file.
+   * Returns the number of bytes read or -1 on error.
+   */
+  ssize_t read(char *dest, size_t n)
+  {
+    if (flush() != ior_ok) {
+      return -1;
     }
-    out = pop();
-    return true;
+    size_t done = std::min(n, in.end - in.start);
+    memcpy(dest, in.data.data() + in.start, done);
+    in.start += done;
+    while (done < n) {
+      if (n - done >= direct_io) {
+        auto r = ::read(fd, dest + done, n - done);
+        if (r < 0 && errno == EINTR) continue;
+        if (r < 0) return -1;
+        if (r == 0) break;
+        done += r;
+      } else {
+        errno = 0;
+        if (!in.fill()) {
+          if (errno && errno != EINTR) return -1;
+          break;
+        }
+        auto chunk = std::min(n - done, in.end - in.start);
+        memcpy(dest + done, in.data.data() + in.start, chunk);
+        in.start += chunk;
+        done += chunk;
+      }
+    }
+    return done;
   }
 
-  int rpop()
+  cell write(const char *src, size_t n)
   {
-    if (rstack.empty()) {
-      error() << "tried to pop from empty return stack";
+    if (!writable) {
+      return ior_file_io;
     }
-    auto result = rstack.back();
-    rstack.pop_back();
-    return result;
+    // Data read ahead of the file position has to be given back first.
+    if (in.end > in.start) {
+      if (lseek(fd, -(off_t)(in.end - in.start), SEEK_CUR) < 0) {
+        return iorFromErrno();
+      }
+      in.start = in.end = 0;
+    }
+    if (n >= direct_io || out.size() - used < n) {
+      auto ior = flush();
+      if (ior != ior_ok) {
+        return ior;
+      }
+    }
+    if (n >= direct_io) {
+      return writeAll(src, n);
+    }
+    memcpy(out.data() + used, src, n);
+    used += n;
+    return ior_ok;
   }
 
-  bool rpop(int& out)
+  cell flush()
   {
-    if (rstack.empty()) {
-      return false;
+    auto ior = writeAll(out.data(), used);
+    used = 0;
+    return ior;
+  }
+
+  cell close()
+  {
+    if (fd < 0) {
+      return ior_ok;
     }
-    out = rpop();
-    return true;
+    auto ior = flush();
+    if (::close(fd) < 0 && ior == ior_ok) {
+      ior = iorFromErrno();
+    }
+    fd = -1;
+    return ior;
   }
 
-  void rpush(int v) {
-    rstack.push_back(v);
+  cell writeAll(const char *src, size_t n)
+  {
+    while (n) {
+      auto w = ::write(fd, src, n);
+      if (w < 0 && errno == EINTR) continue;
+      if (w < 0) return iorFromErrno();
+      src += w;
+      n -= w;
+    }
+    return ior_ok;
   }
 
-  void rpush(token_iterator it) {
-    rpush(addr(it));
+  int fd;
+  bool writable;
+  input_buffer in;
+  std::vector<char> out = std::vector<char>(1 << 20);
+  size_t used = 0;
+};
+
+/*
+ * A file of 1024-byte blocks mapped shared into memory, so block contents
+ * are read and written in place. Blocks marked dirty by update are synced
+ * to disk by flush.
+ */
+struct block_file
+{
+  static constexpr cell block_size = 1024;
+  static constexpr cell max_blocks = 1 << 20;
+
+  explicit block_file(int fd) : fd { fd } { }
+
+  ~block_file()
+  {
+    flush();
+    if (data) {
+      munmap(data, count * block_size);
+    }
+    ::close(fd);
   }
 
-  void rpush() {
-    rpush(ip());
+  /*
+   * Grows the file and its mapping to hold at least n blocks.
+   */
+  cell grow(cell n)
+  {
+    if (n <= count) {
+      return ior_ok;
+    }
+    if (ftruncate(fd, n * block_size) < 0) {
+      return iorFromErrno();
+    }
+    auto p = data ?
+      mremap(data, count * block_size, n * block_size, MREMAP_MAYMOVE) :
+      mmap(nullptr, n * block_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+           fd, 0);
+    if (p == MAP_FAILED) {
+      return iorFromErrno();
+    }
+    data = (char*)p;
+    count = n;
+    return ior_ok;
   }
 
-  int addr(token_iterator it) const {
-    return it - token_stream.begin();
+  cell flush()
+  {
+    auto page = (cell)sysconf(_SC_PAGESIZE);
+    cell ior = ior_ok;
+    for (auto b : dirty) {
+      auto start = b * block_size & ~(page - 1);
+      auto end = (b + 1) * block_size;
+      if (msync(data + start, end - start, MS_SYNC) < 0) {
+        ior = iorFromErrno();
+      }
+    }
+    dirty.clear();
+    return ior;
   }
 
-  int ip() const
+  int fd;
+  char *data = nullptr;
+  cell count = 0;
+  std::set<cell> dirty;
+};
+
+/*
+ * An open-addressing hash table from cells to cells in the style of
+ * SwissTable. Slots are split into groups of 16 and each slot has a control
+ * byte: empty, deleted, or 7 bits of the hash of the key it holds, so a
+ * probe compares a whole group's control bytes at once and only looks at
+ * keys whose hash bits match.
+ *
+ * The table lives in one buffer that is mapped read-only into the address
+ * space: the number of entries, the number of slots, the control bytes, the
+ * keys and the values.
+ */
+struct hash_table
+{
+  static constexpr size_t group_size = 16;
+  static constexpr uint8_t empty = 0x80;
+  static constexpr uint8_t deleted = 0xfe;
+  static constexpr size_t header_cells = 2;
+
+  explicit hash_table(cell capacity)
   {
-    return addr(curr_token);
+    reset(slotsFor(capacity));
   }
 
-  int end_addr() const
+  /*
+   * The number of slots needed to hold n entries below the maximum load
+   * factor of 7/8.
+   */
+  static size_t slotsFor(cell n)
   {
-    return (int)token_stream.size();
+    size_t slots = group_size;
+    while (slots / 8 * 7 < (size_t)std::max<cell>(n, 1)) {
+      slots *= 2;
+    }
+    return slots;
   }
 
-  token_iterator abs_inst(int addr)
+  void reset(size_t slots)
   {
-    return
-      (addr >= 0 && addr < end_addr()) ? token_stream.begin() + addr :
-      (addr < 0)                       ? token_stream.begin()        :
-                                         token_stream.end();
+    data.assign(header_cells + slots / sizeof(cell) + 2 * slots, 0);
+    data[1] = slots;
+    memset(ctrl(), empty, slots);
+    tombstones = 0;
+  }
 
+  cell& count() { return data[0]; }
+  size_t slots() const { return data[1]; }
+  uint8_t *ctrl() { return (uint8_t*)(data.data() + header_cells); }
+  cell *keys() { return data.data() + header_cells + slots() / sizeof(cell); }
+  cell *values() { return keys() + slots(); }
+  const uint8_t *ctrl() const
+  {
+    return (const uint8_t*)(data.data() + header_cells);
+  }
+  const cell *keys() const
+  {
+    return data.data() + header_cells + slots() / sizeof(cell);
   }
+  const cell *values() const { return keys() + slots(); }
 
-  token_iterator rel_inst(int off)
+  static uint64_t hash(cell key)
   {
-    return abs_inst(ip() + off);
+    uint64_t h = key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 33);
   }
 
-  int top()
+  /*
+   * A mask with bit i set if control byte i of the group at slot g is c.
+   */
+  unsigned match(size_t g, uint8_t c) const
   {
-    if (dstack.empty()) {
-      error() << "tried to peek empty stack";
+#ifdef __SSE2__
+    auto group = _mm_loadu_si128((const __m128i*)(ctrl() + g));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)c)));
+#else
+    unsigned mask = 0;
+    for (size_t i = 0; i < group_size; ++i) {
+      mask |= (unsigned)(ctrl()[g + i] == c) << i;
     }
-    return dstack.back();
+    return mask;
+#endif
   }
 
-  int rtop()
+  /*
+   * Calls visit with each group in the probe sequence of a hash until it
+   * returns true. Groups are visited in triangular order, which covers
+   * every group since there is a power of two of them.
+   */
+  template<class F>
+  void probe(uint64_t h, F visit) const
   {
-    if (rstack.empty()) {
-      error() << "tried to peek empty return stack";
+    auto mask = slots() - 1;
+    auto g = h & mask & ~(group_size - 1);
+    for (auto step = group_size; !visit(g); step += group_size) {
+      g = (g + step) & mask;
     }
-    return rstack.back();
   }
 
-  void rbranch(int off)
+  /*
+   * The slot holding key, or -1.
+   */
+  ssize_t find(cell key) const
   {
-    curr_token = rel_inst(off);
+    auto h = hash(key);
+    uint8_t h2 = h >> 57;
+    ssize_t slot = -1;
+    probe(h, [&](size_t g) {
+      for (auto m = match(g, h2); m; m &= m - 1) {
+        auto i = g + __builtin_ctz(m);
+        if (keys()[i] == key) {
+          slot = i;
+          return true;
+        }
+      }
+      return match(g, empty) != 0;
+    });
+    return slot;
   }
 
-  void abranch(int addr)
+  /*
+   * Sets the value of key. Returns true if the buffer was reallocated.
+   */
+  bool insert(cell key, cell value)
   {
-    curr_token = abs_inst(addr);
+    auto i = find(key);
+    if (i >= 0) {
+      values()[i] = value;
+      return false;
+    }
+    auto resized = false;
+    if ((size_t)(count() + tombstones + 1) > slots() / 8 * 7) {
+      rehash(slotsFor(2 * (count() + 1)));
+      resized = true;
+    }
+    add(key, value);
+    return resized;
   }
 
-  bool branchTo(std::function<bool(const token&)> pred) {
-    while (!atEnd() && !pred(*curr_token)) { next(); }
-    return !atEnd() && pred(*curr_token);
+  bool erase(cell key)
+  {
+    auto i = find(key);
+    if (i < 0) {
+      return false;
+    }
+    // Probes stop at a group with an empty slot, so the slot only needs to
+    // stay marked as deleted if there are none in its group.
+    auto g = i & ~(group_size - 1);
+    if (match(g, empty)) {
+      ctrl()[i] = empty;
+    } else {
+      ctrl()[i] = deleted;
+      ++tombstones;
+    }
+    --count();
+    return true;
   }
 
-  template<class... T>
-  bool branchTo(const char *id, T&&... args)
+  std::vector<cell> data;
+  size_t tombstones = 0;
+
+private:
+  void add(cell key, cell value)
   {
-    std::vector<const char*> ids { id, std::forward<T&&>(args)... };
-    return branchTo([ids = std::move(ids)](const token& t) {
-        for (auto id : ids) {
-          if (isTokenWithId(id, t)) {
-            return true;
-          }
-        }
+    auto h = hash(key);
+    probe(h, [&](size_t g) {
+      auto m = match(g, empty) | match(g, deleted);
+      if (!m) {
         return false;
       }
-    );
+      auto i = g + __builtin_ctz(m);
+      tombstones -= ctrl()[i] == deleted;
+      ctrl()[i] = h >> 57;
+      keys()[i] = key;
+      values()[i] = value;
+      ++count();
+      return true;
+    });
   }
 
-  bool atEnd() const {
-    return curr_token == token_stream.end();
+  void rehash(size_t slots)
+  {
+    hash_table old { 0 };
+    std::swap(old.data, data);
+    reset(slots);
+    for (size_t i = 0; i < old.slots(); ++i) {
+      if (old.ctrl()[i] < empty) {
+        add(old.keys()[i], old.values()[i]);
+      }
+    }
   }
+};
 
-  void next() { rbranch(1); }
+/*
+ * An arbitrary-precision integer: a sign and a magnitude in 64-bit limbs,
+ * least significant first, with no leading zero limbs (zero has none).
+ */
+struct bignum
+{
+  using limbs = std::vector<uint64_t>;
+  using u128 = unsigned __int128;
 
-  void exit() {
-    int rip;
-    if (!rpop(rip)) {
-      error() << "tried to exit from a subroutine with an "
-              << "empty return stack.";
-    } else if (rip < 0 || rip > end_addr()) {
-      error() << "exit from subroutine to invalid address ("
-              << rip << ")";
+  // Multiplications where both operands have at least this many limbs are
+  // split in three with Karatsuba's method.
+  static constexpr size_t karatsuba_min = 32;
+  // Numbers with at most this many limbs are converted to decimal by
+  // repeated division; larger ones are split in two first.
+  static constexpr size_t decimal_split_min = 16;
+
+  bool negative = false;
+  limbs mag;
+
+  static bignum fromCell(cell n)
+  {
+    bignum b;
+    b.negative = n < 0;
+    auto m = n < 0 ? -(ucell)n : (ucell)n;
+    if (m) {
+      b.mag.push_back(m);
     }
-    abranch(rip);
+    return b;
   }
 
-  int run()
+  static void trim(limbs& a)
   {
-    while (!atEnd()) {
-      curr_token->interpret(*this, *curr_token);
+    while (!a.empty() && !a.back()) {
+      a.pop_back();
     }
-    return dstack.empty() ? 0 : dstack.back();
   }
 
-  bool intrinsic(const std::string& id);
-
-  std::map<std::string, token_iterator> dictionary;
-  std::map<std::string, token_iterator> labels;
-  std::deque<int> dstack;
-  std::deque<int> rstack;
-  std::vector<token> token_stream;
-  token_iterator curr_token;
-};
-
-bool isBranchTargetToken(const token& tok)
-{
-  return tok.kind == tokens::number ||
-         tok.kind == tokens::identifier;
-}
-
-void branch_to_target(machine_state& m, bool do_branch = true)
-{
-  m.next();
-  m.assert(!m.atEnd() || isBranchTargetToken(*m.curr_token))
-    << "branch word without target.";
-  if (!do_branch) {
-    m.next();
-    return;
+  static int compare(const limbs& a, const limbs& b)
+  {
+    if (a.size() != b.size()) {
+      return a.size() < b.size() ? -1 : 1;
+    }
+    for (auto i = a.size(); i-- > 0; ) {
+      if (a[i] != b[i]) {
+        return a[i] < b[i] ? -1 : 1;
+      }
+    }
+    return 0;
   }
 
-  if (m.curr_token->kind == tokens::number) {
-    m.rbranch(strtol(m.curr_token->start, nullptr, 0));
-    return;
+  /*
+   * a += b << (64 * shift)
+   */
+  static void addTo(limbs& a, const limbs& b, size_t shift = 0)
+  {
+    if (a.size() < b.size() + shift) {
+      a.resize(b.size() + shift);
+    }
+    uint64_t carry = 0;
+    size_t i = 0;
+    for (; i < b.size(); ++i) {
+      u128 sum = (u128)a[i + shift] + b[i] + carry;
+      a[i + shift] = (uint64_t)sum;
+      carry = sum >> 64;
+    }
+    for (i += shift; carry && i < a.size(); ++i) {
+      carry = !++a[i];
+    }
+    if (carry) {
+      a.push_back(1);
+    }
   }
 
-  auto it = m.labels.find(m.curr_token->to_string());
-  m.assert(it != m.labels.end())
-    << "tried to branch to nonexistent label " << *m.curr_token;
-
-  m.curr_token = it->second;
-}
+  /*
+   * a -= b, where a >= b.
+   */
+  static void subFrom(limbs& a, const limbs& b)
+  {
+    uint64_t borrow = 0;
+    for (size_t i = 0; i < a.size() && (i < b.size() || borrow); ++i) {
+      auto x = a[i], y = i < b.size() ? b[i] : 0;
+      a[i] = x - y - borrow;
+      borrow = x < y || (x == y && borrow);
+    }
+    trim(a);
+  }
 
-std::map<std::string, void(*)(machine_state&)> intrinsics {
+  static limbs add(const limbs& a, const limbs& b)
   {
-    "dup",
-    [](machine_state& m) {
-      m.push(m.top());
-      m.next();
-    },
-  },
+    auto r = a;
+    addTo(r, b);
+    return r;
+  }
+
+  static limbs mulSchoolbook(const limbs& a, const limbs& b)
   {
-    "swap",
-    [](machine_state& m) {
-      auto b = m.pop();
-      auto a = m.pop();
-      m.push(b);
-      m.push(a);
-      m.next();
+    limbs r(a.size() + b.size());
+    for (size_t i = 0; i < a.size(); ++i) {
+      uint64_t carry = 0;
+      for (size_t j = 0; j < b.size(); ++j) {
+        u128 p = (u128)a[i] * b[j] + r[i + j] + carry;
+        r[i + j] = (uint64_t)p;
+        carry = p >> 64;
+      }
+      r[i + b.size()] = carry;
     }
-  },
+    trim(r);
+    return r;
+  }
+
+  static limbs mul(const limbs& a, const limbs& b)
   {
-    "over",
-    [](machine_state& m) {
-      auto b = m.pop();
-      auto a = m.pop();
-      m.push(a);
-      m.push(b);
-      m.push(a);
-      m.next();
+    if (a.size() < b.size()) {
+      return mul(b, a);
     }
-  },
-  {
-    "rot",
-    [](machine_state& m) {
-      auto c = m.pop();
-      auto b = m.pop();
-      auto a = m.pop();
-      m.push(b);
-      m.push(c);
-      m.push(a);
-      m.next();
+    if (b.size() < karatsuba_min) {
+      return mulSchoolbook(a, b);
     }
-  },
-  {
-    "drop",
-    [](machine_state& m) {
-      (void)m.pop();
-      m.next();
+    // Multiply a much longer a one b-sized chunk at a time.
+    if (a.size() >= 2 * b.size()) {
+      limbs r;
+      for (size_t i = 0; i < a.size(); i += b.size()) {
+        limbs chunk(a.begin() + i,
+                    a.begin() + std::min(a.size(), i + b.size()));
+        trim(chunk);
+        addTo(r, mul(chunk, b), i);
+      }
+      trim(r);
+      return r;
     }
-  },
+
+    // a = a1 B^h + a0, b = b1 B^h + b0, so a b = z2 B^2h + z1 B^h + z0 with
+    // z1 = (a0 + a1)(b0 + b1) - z2 - z0.
+    auto h = a.size() / 2;
+    auto lo = [h](const limbs& x) {
+      limbs r(x.begin(), x.begin() + std::min(h, x.size()));
+      trim(r);
+      return r;
+    };
+    auto hi = [h](const limbs& x) {
+      return x.size() > h ? limbs(x.begin() + h, x.end()) : limbs { };
+    };
+    auto a0 = lo(a), a1 = hi(a), b0 = lo(b), b1 = hi(b);
+    auto z0 = mul(a0, b0);
+    auto z2 = mul(a1, b1);
+    auto z1 = mul(add(a0, a1), add(b0, b1));
+    subFrom(z1, z0);
+    subFrom(z1, z2);
+    auto r = z0;
+    addTo(r, z1, h);
+    addTo(r, z2, 2 * h);
+    trim(r);
+    return r;
+  }
+
+  /*
+   * Divides a by b (not zero) with Knuth's algorithm D.
+   */
+  static void divMod(const limbs& a, const limbs& b, limbs& q, limbs& r)
   {
-    "clear",
-    [](machine_state& m) {
-      m.dstack.clear();
-      m.next();
+    if (compare(a, b) < 0) {
+      q.clear();
+      r = a;
+      return;
     }
-  },
-  {
-    "if",
-    [](machine_state& m) {
-      if (!m.pop()) {
-        m.next();
-        int counter = 0;
-        auto pred = [&counter](const token& tok) {
-          if (counter == 0 &&
-            (isTokenWithId("else", tok) || isTokenWithId("then", tok))) {
-            return true;
-          }
-
-          if (isTokenWithId("if", tok)) {
-            ++counter;
-          }
-          if (counter && isTokenWithId("then", tok)) {
-            --counter;
-          }
-          return false;
-        };
-        if (!m.branchTo(pred)) {
-          m.error() << "'if' with no corresponding 'then'";
-        }
+    if (b.size() == 1) {
+      q.assign(a.size(), 0);
+      u128 rem = 0;
+      for (auto i = a.size(); i-- > 0; ) {
+        auto cur = (rem << 64) | a[i];
+        q[i] = (uint64_t)(cur / b[0]);
+        rem = cur % b[0];
       }
-      m.next();
+      trim(q);
+      r.clear();
+      if (rem) {
+        r.push_back((uint64_t)rem);
+      }
+      return;
     }
-  },
-  {
-    "else",
-    [](machine_state& m) {
-      int counter = 0;
-      m.next();
-      auto pred = [&counter](const token& tok) {
-        if (counter == 0 && isTokenWithId("then", tok)) {
-          return true;
+
+    // Shift both so the divisor's top bit is set, which keeps each estimated
+    // quotient limb at most two too large.
+    auto s = __builtin_clzll(b.back());
+    auto shl = [s](const limbs& x, size_t extra) {
+      limbs r(x.size() + extra);
+      for (size_t i = 0; i < x.size(); ++i) {
+        r[i] |= x[i] << s;
+        if (s) {
+          r[i + 1] |= x[i] >> (64 - s);
         }
-        if (isTokenWithId("if", tok)) {
-          ++counter;
+      }
+      return r;
+    };
+    auto v = shl(b, 1);
+    v.pop_back();
+    auto u = shl(a, 1);
+    auto n = v.size(), m = a.size() - n;
+    q.assign(m + 1, 0);
+    for (auto j = m + 1; j-- > 0; ) {
+      auto num = ((u128)u[j + n] << 64) | u[j + n - 1];
+      auto qhat = num / v[n - 1], rhat = num % v[n - 1];
+      while ((qhat >> 64) ||
+             qhat * v[n - 2] > ((rhat << 64) | u[j + n - 2])) {
+        --qhat;
+        rhat += v[n - 1];
+        if (rhat >> 64) {
+          break;
         }
-        if (isTokenWithId("then", tok)) {
-          --counter;
+      }
+
+      uint64_t borrow = 0, carry = 0;
+      for (size_t i = 0; i < n; ++i) {
+        auto p = (u128)(uint64_t)qhat * v[i] + carry;
+        carry = p >> 64;
+        auto x = u[i + j], lo = (uint64_t)p;
+        u[i + j] = x - lo - borrow;
+        borrow = x < lo || (x - lo < borrow);
+      }
+      auto top = u[j + n];
+      u[j + n] = top - carry - borrow;
+      if (top < carry || top - carry < borrow) {
+        // The estimate was one too large: add the divisor back.
+        --qhat;
+        uint64_t c = 0;
+        for (size_t i = 0; i < n; ++i) {
+          u128 sum = (u128)u[i + j] + v[i] + c;
+          u[i + j] = (uint64_t)sum;
+          c = sum >> 64;
         }
-        return false;
-      };
-      if (!m.branchTo(pred)) {
-        m.error() << "'else' with no corresponding 'then'";
+        u[j + n] += c;
       }
-      m.next();
+      q[j] = (uint64_t)qhat;
     }
-  },
-  {
-    "then",
-    [](machine_state& m) { m.next(); }
-  },
-  {
-    "branch",
-    [](machine_state& m) {
-      branch_to_target(m);
+    trim(q);
+
+    r.assign(n, 0);
+    for (size_t i = 0; i < n; ++i) {
+      r[i] = u[i] >> s;
+      if (s) {
+        r[i] |= u[i + 1] << (64 - s);
+      }
     }
-  },
+    trim(r);
+  }
+
+  /*
+   * Appends the decimal digits of x, zero-padded to width digits. Large
+   * numbers are split by a power of ten about half their size, and the two
+   * halves converted separately; powers[k] is 10^(19 * 2^k).
+   */
+  static void decimal(
+    const limbs& x, size_t width, std::vector<limbs>& powers,
+    std::string& out)
   {
-    "?branch",
-    [](machine_state& m) {
-      branch_to_target(m, m.pop() != 0);
+    if (x.size() <= decimal_split_min) {
+      std::string digits;
+      limbs q, r, cur = x;
+      const limbs chunk { 10000000000000000000ull };
+      while (!cur.empty()) {
+        divMod(cur, chunk, q, r);
+        auto d = r.empty() ? 0 : r[0];
+        for (int i = 0; i < 19; ++i, d /= 10) {
+          digits.push_back('0' + d % 10);
+        }
+        cur.swap(q);
+      }
+      while (digits.size() > 1 && digits.back() == '0') {
+        digits.pop_back();
+      }
+      if (digits.size() < width) {
+        digits.resize(width, '0');
+      }
+      out.append(digits.rbegin(), digits.rend());
+      return;
     }
-  },
-  {
-    ">r",
-    [](machine_state& m) {
-      m.rpush(m.pop());
-      m.next();
+
+    size_t k = 0;
+    while (true) {
+      if (k + 1 == powers.size()) {
+        powers.push_back(mul(powers[k], powers[k]));
+      }
+      if (powers[k + 1].size() * 2 > x.size() + 1) {
+        break;
+      }
+      ++k;
     }
-  },
+    limbs q, r;
+    divMod(x, powers[k], q, r);
+    auto low = (size_t)19 << k;
+    decimal(q, width > low ? width - low : 0, powers, out);
+    decimal(r, low, powers, out);
+  }
+
+  std::string to_string() const
   {
-    "r>",
-    [](machine_state& m) {
-      m.push(m.rpop());
-      m.next();
-    }
-  },
+    std::vector<limbs> powers { { 10000000000000000000ull } };
+    std::string out = negative && !mag.empty() ? "-" : "";
+    decimal(mag, 1, powers, out);
+    return out;
+  }
+
+  friend bignum operator+(const bignum& a, const bignum& b)
   {
-    "r@",
-    [](machine_state& m) {
-      m.push(m.rtop());
-      m.next();
+    bignum r;
+    if (a.negative == b.negative) {
+      r.negative = a.negative;
+      r.mag = add(a.mag, b.mag);
+    } else if (compare(a.mag, b.mag) >= 0) {
+      r.negative = a.negative;
+      r.mag = a.mag;
+      subFrom(r.mag, b.mag);
+    } else {
+      r.negative = b.negative;
+      r.mag = b.mag;
+      subFrom(r.mag, a.mag);
     }
-  },
+    r.negative &= !r.mag.empty();
+    return r;
+  }
+
+  friend bignum operator-(const bignum& a, bignum b)
   {
-    "rdrop",
-    [](machine_state& m) {
-      m.rpop();
-      m.next();
-    }
-  },
+    b.negative = !b.negative;
+    return a + b;
+  }
+
+  friend bignum operator*(const bignum& a, const bignum& b)
   {
-    "rclear",
-    [](machine_state& m) {
-      m.rstack.clear();
-      m.next();
-    }
-  },
+    bignum r;
+    r.mag = mul(a.mag, b.mag);
+    r.negative = a.negative != b.negative && !r.mag.empty();
+    return r;
+  }
+
+  /*
+   * Truncating division, like / and % on cells: the remainder has the sign
+   * of the dividend.
+   */
+  static void divMod(const bignum& a, const bignum& b, bignum& q, bignum& r)
   {
-    "cr",
+    divMod(a.mag, b.mag, q.mag, r.mag);
+    q.negative = a.negative != b.negative && !q.mag.empty();
+    r.negative = a.negative && !r.mag.empty();
+  }
+};
+
+/*
+ * A range of the machine's address space backed by host memory.
+ */
+struct memory_region
+{
+  cell base;
+  cell size;
+  char *data;
+  bool writable;
+};
+
+/*
+ * A step of the code that an immediate word or 'literal' generated in place
+ * of itself: push a number, or run the token at an address.
+ */
+struct generated_op
+{
+  bool run_token;
+  cell value;
+};
+
+struct machine_state
+{
+  machine_state(token_vector tokens) :
+    symbols {
+      0, std::hash<std::string> { }, std::equal_to<std::string> { },
+      tokens.get_allocator()
+    },
+    symbol_names { tokens.get_allocator() },
+    labels { tokens.get_allocator() },
+    token_stream { std::move(tokens) },
+    curr_token { token_stream.begin() },
+    data_space(sizeof(cell))
+  {
+    store(base_addr, 10);
+    for (auto it = token_stream.begin(); it != token_stream.end(); ++it) {
+      if (it->kind != tokens::label) continue;
+
+      labels[std::string { it->start + 1, it->end - 1 }] = it;
+    }
+
+    // Map the program text so string literals can refer to it in place.
+    if (!token_stream.empty()) {
+      text_begin = token_stream.front().start;
+      auto text_end = token_stream.front().end;
+      for (auto& t : token_stream) {
+        text_begin = std::min(text_begin, t.start);
+        text_end = std::max(text_end, t.end);
+      }
+      text_base = map_region(
+        const_cast<char*>(text_begin), text_end - text_begin, false);
+    }
+  }
+
+  cell text_addr(const char *p) const
+  {
+    return text_base + (p - text_begin);
+  }
+
+  void push(cell n)
+  {
+    dstack.push_back(n);
+  }
+
+  // Prints the top limit cells of s, or all of them if limit is negative.
+  static void print_stack(
+    std::ostream& out, const std::deque<cell>& s, int limit)
+  {
+    size_t first = 0;
+    out << "[";
+    if (limit >= 0 && s.size() > (size_t)limit) {
+      first = s.size() - limit;
+      out << "... ";
+    }
+    for (size_t i = first; i < s.size(); ++i) {
+      auto idx = s.size() - i - 1;
+      out << idx << ":" << s[i] << (idx == 0 ? "" : " ");
+    }
+    out << "]\n";
+  }
+
+  /*
+   * Prints the tokens within dump_window of ip and the top dump_cells cells
+   * of each stack; negative values print everything.
+   */
+  void debug(std::ostream& out) const
+  {
+    cell begin = 0, end = end_addr();
+    if (dump_window >= 0) {
+      begin = std::max<cell>(ip() - dump_window, 0);
+      end = std::min<cell>(ip() + dump_window + 1, end);
+    }
+    out << "========= machine state =========\n";
+    out << "token stream:\n";
+    if (begin > 0) {
+      out << "... ";
+    }
+    for (auto i = begin; i < end; ++i) {
+      out << i << ":[" << *abs_inst(i) << "] ";
+    }
+    if (end < end_addr()) {
+      out << "... ";
+    }
+    out << "\n\ndata stack:\n";
+    print_stack(out, dstack, dump_cells);
+    out << "\nreturn stack:\n";
+    print_stack(out, rstack, dump_cells);
+    out << "\nip: " << ip() << " "
+        << (atEnd() ? std::string { "\n"}
+                    : ("(" + curr_token->to_string() + ")\n"));
+    out << "=================================";
+    out << std::endl;
+  }
+
+  struct error_state
+  {
+    error_state() : m { nullptr } { }
+    error_state(const machine_state& m, cell code) : m { &m }, code { code }
+    { }
+    error_state(error_state&& es) :
+      m { es.m }, code { es.code }, ss { std::move(es.ss) }
+    {
+      es.m = nullptr;
+    }
+    ~error_state() noexcept(false) {
+      if (m && m->speculative) {
+        m = nullptr;
+        throw speculation_failed { };
+      }
+      if (m && m->catch_frames) {
+        m = nullptr;
+        throw forth_exception { code };
+      }
+      if (m) {
+        ss << "\n";
+        m->debug(ss);
+        output.flush();
+        std::cerr << ss.str() << std::endl;
+        if (m->core_dump) {
+          m->core_dump(*m);
+        }
+        ::exit(1);
+      }
+    }
+
+    const machine_state *m;
+    cell code = throw_other;
+    std::stringstream ss;
+
+    template<class T>
+    error_state& operator<<(T&& op)
+    {
+      ss << std::forward<T&&>(op);
+      return *this;
+    }
+
+    error_state& operator<<(std::basic_ostream<char>& (*fn)(std::basic_ostream<char>&)) {
+      ss << fn;
+      return *this;
+    }
+  };
+
+  error_state error(cell code = throw_other) const
+  {
+    error_state es { *this, code };
+    es << "error interpreting token " << *curr_token << ": ";
+    return es;
+  }
+
+  error_state assert(bool val, cell code = throw_other) const
+  {
+    if (!val) {
+      error_state es { *this, code };
+      es << "assertion while interpreting token " << *curr_token << ": ";
+      return es;
+    }
+    return error_state { };
+  }
+
+  cell pop()
+  {
+    if (dstack.empty()) {
+      error(throw_stack_underflow) << "tried to pop from empty stack";
+    }
+    auto result = dstack.back();
+    dstack.pop_back();
+    return result;
+  }
+
+  bool pop(cell& out)
+  {
+    if (dstack.empty()) {
+      return false;
+    }
+    out = pop();
+    return true;
+  }
+
+  cell rpop()
+  {
+    if (rstack.empty()) {
+      error(throw_rstack_underflow) << "tried to pop from empty return stack";
+    }
+    auto result = rstack.back();
+    rstack.pop_back();
+    return result;
+  }
+
+  bool rpop(cell& out)
+  {
+    if (rstack.empty()) {
+      return false;
+    }
+    out = rpop();
+    return true;
+  }
+
+  void rpush(cell v) {
+    rstack.push_back(v);
+  }
+
+  void rpush(token_iterator it) {
+    rpush(addr(it));
+  }
+
+  void rpush() {
+    rpush(ip());
+  }
+
+  int addr(token_iterator it) const {
+    return it - token_stream.begin();
+  }
+
+  int ip() const
+  {
+    return addr(curr_token);
+  }
+
+  int end_addr() const
+  {
+    return (int)token_stream.size();
+  }
+
+  token_iterator abs_inst(int addr) const
+  {
+    addr = std::max(0, std::min(addr, end_addr()));
+    return token_stream.begin() + addr;
+  }
+
+  token_iterator rel_inst(int off) const
+  {
+    return abs_inst(ip() + off);
+  }
+
+  cell top()
+  {
+    if (dstack.empty()) {
+      error(throw_stack_underflow) << "tried to peek empty stack";
+    }
+    return dstack.back();
+  }
+
+  cell rtop()
+  {
+    if (rstack.empty()) {
+      error(throw_rstack_underflow) << "tried to peek empty return stack";
+    }
+    return rstack.back();
+  }
+
+  void rbranch(int off)
+  {
+    curr_token = rel_inst(off);
+  }
+
+  void abranch(int addr)
+  {
+    curr_token = abs_inst(addr);
+  }
+
+  bool branchTo(std::function<bool(const token&)> pred) {
+    while (!atEnd() && !pred(*curr_token)) { next(); }
+    return !atEnd() && pred(*curr_token);
+  }
+
+  template<class... T>
+  bool branchTo(const char *id, T&&... args)
+  {
+    std::vector<const char*> ids { id, std::forward<T&&>(args)... };
+    return branchTo([ids = std::move(ids)](const token& t) {
+        for (auto id : ids) {
+          if (isTokenWithId(id, t)) {
+            return true;
+          }
+        }
+        return false;
+      }
+    );
+  }
+
+  bool atEnd() const {
+    return curr_token == token_stream.end();
+  }
+
+  void next() { rbranch(1); }
+
+  void exit() {
+    cell rip;
+    if (!rpop(rip)) {
+      error() << "tried to exit from a subroutine with an "
+              << "empty return stack.";
+    } else if (rip < 0 || rip > end_addr()) {
+      error() << "exit from subroutine to invalid address ("
+              << rip << ")";
+    }
+    abranch(rip);
+  }
+
+  int run()
+  {
+    while (!atEnd()) {
+      curr_token->interpret(*this, *curr_token);
+    }
+    return exit_code();
+  }
+
+  int exit_code() const
+  {
+    return dstack.empty() ? 0 : dstack.back();
+  }
+
+  bool intrinsic(const std::string& id);
+
+  /*
+   * Execution tokens are the address of a word's body, or for intrinsics a
+   * negative number indexing intrinsic_xts.
+   */
+  cell xt(const std::string& id);
+  void execute(cell xt);
+  void execute_nested(cell xt);
+
+  void run_token();
+  bool is_immediate(const token& tok) const;
+  void compile_definition(const std::string& name);
+  void patch_site(int site);
+  void bind(int addr, cell target);
+
+  static constexpr cell forth_wordlist = 0;
+
+  cell intern(const std::string& name)
+  {
+    auto it = symbols.find(name);
+    if (it == symbols.end()) {
+      it = symbols.emplace(name, symbol_names.size()).first;
+      symbol_names.push_back(name);
+    }
+    return it->second;
+  }
+
+  /*
+   * The address of the body of the word named name in the search order,
+   * or -1.
+   */
+  int find_word(const std::string& name) const
+  {
+    auto sym = symbols.find(name);
+    if (sym == symbols.end()) {
+      return -1;
+    }
+    for (auto wid : search_order) {
+      auto& words = wordlists[wid];
+      auto slot = words.find(sym->second);
+      if (slot >= 0) {
+        return words.values()[slot];
+      }
+    }
+    return -1;
+  }
+
+  void define_word(const std::string& name, int addr)
+  {
+    wordlists[current].insert(intern(name), addr);
+  }
+
+  void forget_word(const std::string& name)
+  {
+    auto sym = symbols.find(name);
+    if (sym != symbols.end()) {
+      wordlists[current].erase(sym->second);
+    }
+  }
+
+  cell wordlist_arg(cell wid) const
+  {
+    assert(wid >= 0 && wid < (cell)wordlists.size()) << "invalid wordlist " << wid;
+    return wid;
+  }
+
+  /*
+   * Translates the len bytes at addr into host memory. Returns null unless
+   * they are all inside of the data space or of a single mapped region (and
+   * the region is writable, if requested).
+   */
+  char *translate(cell addr, cell len, bool write = false) const
+  {
+    if (len < 0) {
+      return nullptr;
+    }
+    if (addr >= data_space_base &&
+        addr - data_space_base <= (cell)data_space.size() - len) {
+      return const_cast<char*>(data_space.data()) + (addr - data_space_base);
+    }
+    for (auto& r : regions) {
+      if (addr >= r.base && addr - r.base <= r.size - len &&
+          (r.writable || !write)) {
+        return r.data + (addr - r.base);
+      }
+    }
+    return nullptr;
+  }
+
+  bool valid(cell addr, cell len, bool write = false) const
+  {
+    return translate(addr, len, write) != nullptr;
+  }
+
+  /*
+   * Returns a pointer to the len bytes of memory at addr.
+   */
+  char *mem(cell addr, cell len, bool write = false)
+  {
+    auto p = translate(addr, len, write);
+    if (!p) {
+      error(throw_invalid_address)
+        << "invalid memory " << (write ? "write" : "read") << " of "
+              << len << " bytes at address " << addr;
+    }
+    return p;
+  }
+
+  /*
+   * Like valid and mem, for the n cells at addr. n is checked before it is
+   * scaled, so huge counts can't wrap around to a small length.
+   */
+  bool valid_cells(cell addr, cell n, bool write = false) const
+  {
+    return n >= 0 &&
+           n <= std::numeric_limits<cell>::max() / (cell)sizeof(cell) &&
+           valid(addr, n * sizeof(cell), write);
+  }
+
+  char *mem_cells(cell addr, cell n, bool write = false)
+  {
+    if (!valid_cells(addr, n, write)) {
+      error(throw_invalid_address)
+        << "invalid memory " << (write ? "write" : "read") << " of "
+        << n << " cells at address " << addr;
+    }
+    return mem(addr, n * sizeof(cell), write);
+  }
+
+  /*
+   * Makes size bytes of host memory addressable by the program and returns
+   * the address they start at. The region may later grow up to reserve
+   * bytes without moving.
+   */
+  cell map_region(char *data, cell size, bool writable, cell reserve = 0)
+  {
+    auto base = next_region_base;
+    auto span = std::max(size, reserve);
+    next_region_base += (span / region_align + 1) * region_align;
+    regions.push_back(memory_region { base, size, data, writable });
+    return base;
+  }
+
+  void unmap_region(cell base)
+  {
+    for (auto it = regions.begin(); it != regions.end(); ++it) {
+      if (it->base == base) {
+        regions.erase(it);
+        return;
+      }
+    }
+  }
+
+  /*
+   * Maps the named file into the address space, read-only or copy-on-write.
+   * Returns an ior.
+   */
+  cell map_file(
+    const std::string& name, bool copy_on_write, cell& addr, cell& len)
+  {
+    addr = len = 0;
+    auto fd = open(name.c_str(), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+      auto ior = iorFromErrno();
+      if (fd >= 0) {
+        close(fd);
+      }
+      return ior;
+    }
+    if (!st.st_size) {
+      close(fd);
+      return ior_ok;
+    }
+
+    auto prot = PROT_READ | (copy_on_write ? PROT_WRITE : 0);
+    auto p = mmap(nullptr, st.st_size, prot, MAP_PRIVATE, fd, 0);
+    auto ior = p == MAP_FAILED ? iorFromErrno() : ior_ok;
+    close(fd);
+    if (p == MAP_FAILED) {
+      return ior;
+    }
+    addr = map_region((char*)p, st.st_size, copy_on_write);
+    len = st.st_size;
+    mapped_files[addr] = st.st_size;
+    return ior_ok;
+  }
+
+  memory_region *region_at(cell base)
+  {
+    for (auto& r : regions) {
+      if (r.base == base) {
+        return &r;
+      }
+    }
+    return nullptr;
+  }
+
+  /*
+   * Opens the block file, creating it if needed. Any block file that was
+   * already open is flushed and closed.
+   */
+  cell open_blocks(const std::string& name)
+  {
+    if (blocks_) {
+      blocks_.reset();
+      unmap_region(blocks_base);
+      current_block = -1;
+    }
+    auto fd = open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+      return iorFromErrno();
+    }
+    // Only kept once it's mapped, so 'block' never sees a file without a
+    // region.
+    std::unique_ptr<block_file> blocks { new block_file { fd } };
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+      return iorFromErrno();
+    }
+    auto ior = blocks->grow(st.st_size / block_file::block_size);
+    blocks_base = map_region(blocks->data,
+      blocks->count * block_file::block_size, true,
+      block_file::max_blocks * block_file::block_size);
+    blocks_ = std::move(blocks);
+    return ior;
+  }
+
+  /*
+   * The address of block u, growing the block file if it doesn't reach
+   * that far yet. Block u becomes the current block for update.
+   */
+  cell block(cell u)
+  {
+    assert(blocks_ != nullptr) << "no block file is open";
+    assert(u >= 0 && u < block_file::max_blocks) << "invalid block " << u;
+    if (blocks_->grow(u + 1) != ior_ok) {
+      error() << "couldn't grow the block file to " << u + 1 << " blocks";
+    }
+    auto r = region_at(blocks_base);
+    r->data = blocks_->data;
+    r->size = blocks_->count * block_file::block_size;
+    current_block = u;
+    return blocks_base + u * block_file::block_size;
+  }
+
+  /*
+   * Creates a hash table with room for capacity entries before it first
+   * grows and returns its address.
+   */
+  cell new_hash_table(cell capacity)
+  {
+    std::unique_ptr<hash_table> t { new hash_table { capacity } };
+    auto base = map_region((char*)t->data.data(),
+      t->data.size() * sizeof(cell), false, max_hash_table);
+    hash_tables[base] = std::move(t);
+    return base;
+  }
+
+  hash_table& hash_table_at(cell ht)
+  {
+    auto it = hash_tables.find(ht);
+    if (it == hash_tables.end()) {
+      error() << "no hash table at address " << ht;
+    }
+    return *it->second;
+  }
+
+  /*
+   * Updates the mapping of a hash table after its buffer was reallocated.
+   */
+  void sync_hash_table(cell ht)
+  {
+    auto& t = hash_table_at(ht);
+    auto r = region_at(ht);
+    r->data = (char*)t.data.data();
+    r->size = t.data.size() * sizeof(cell);
+  }
+
+  /*
+   * Stores a bignum and returns its handle. Handles are small positive
+   * numbers; those of freed bignums are reused.
+   */
+  cell new_bignum(bignum b)
+  {
+    size_t slot = 0;
+    while (slot < bignums.size() && bignums[slot]) {
+      ++slot;
+    }
+    if (slot == bignums.size()) {
+      bignums.emplace_back();
+    }
+    bignums[slot].reset(new bignum(std::move(b)));
+    return slot + 1;
+  }
+
+  bignum& bignum_at(cell h)
+  {
+    if (h < 1 || h > (cell)bignums.size() || !bignums[h - 1]) {
+      error() << "invalid bignum handle " << h;
+    }
+    return *bignums[h - 1];
+  }
+
+  block_file& blocks()
+  {
+    assert(blocks_ != nullptr) << "no block file is open";
+    return *blocks_;
+  }
+
+  /*
+   * Defines name as the table whose token starts at text, replacing any
+   * word of that name. The cells are mapped into memory the first time the
+   * table is defined.
+   */
+  void define_table(
+    const std::string& name, const char *text, const std::vector<cell>& cells)
+  {
+    auto it = table_bases.find(text);
+    if (it == table_bases.end()) {
+      auto size = (cell)(cells.size() * sizeof(cell));
+      it = table_bases.emplace(
+        text, map_region((char*)cells.data(), size, false)).first;
+    }
+    forget_word(name);
+    tables[name] = std::make_pair(it->second, (cell)cells.size());
+  }
+
+  /*
+   * The reader for the program's input, whose buffer is mapped read-only
+   * into the address space so lines can be handed out without copying.
+   */
+  input_buffer& input()
+  {
+    if (!input_) {
+      input_.reset(new input_buffer { input_fd, max_input_buffer });
+      input_base = map_region(
+        input_->data.data(), input_->data.size(), false, max_input_buffer);
+    }
+    return *input_;
+  }
+
+  /*
+   * Updates the mapping of the input buffer, which may have moved or grown
+   * while reading, and reports a line that didn't fit in it.
+   */
+  void sync_input()
+  {
+    auto r = region_at(input_base);
+    r->data = input_->data.data();
+    r->size = input_->data.size();
+    if (input_->overflowed) {
+      input_->overflowed = false;
+      error() << "input line longer than " << (max_input_buffer >> 20)
+              << " MiB";
+    }
+  }
+
+  /*
+   * Returns the open file with the given id, or null.
+   */
+  file *fileById(cell id)
+  {
+    if (id < 1 || id > (cell)files.size()) {
+      return nullptr;
+    }
+    return files[id - 1].get();
+  }
+
+  cell input_addr(const char *p) const
+  {
+    return input_base + (p - input_->data.data());
+  }
+
+  cell fetch(cell addr)
+  {
+    cell result;
+    memcpy(&result, mem(addr, sizeof(cell)), sizeof(cell));
+    return result;
+  }
+
+  void store(cell addr, cell value)
+  {
+    memcpy(mem(addr, sizeof(cell), true), &value, sizeof(cell));
+  }
+
+  cell here() const
+  {
+    return data_space_base + (cell)data_space.size();
+  }
+
+  /*
+   * The numeric base used for printing numbers.
+   */
+  unsigned base()
+  {
+    auto b = fetch(base_addr);
+    if (b < 2 || b > 36) {
+      error() << "invalid numeric base " << b;
+    }
+    return b;
+  }
+
+  // Address of the first byte of the data space. Address 0 is never valid.
+  static constexpr cell data_space_base = 0x10000;
+  // Regions are mapped after the largest possible data space.
+  static constexpr cell region_align = 0x10000;
+  static constexpr cell first_region_base = 0x40010000;
+  static constexpr cell max_input_buffer = 1 << 26;
+  static constexpr cell max_hash_table = 1ll << 36;
+  // Variables at the start of the data space.
+  static constexpr cell base_addr = data_space_base;
+  static constexpr cell max_data_space = 1 << 30;
+
+  // Words are kept in wordlists, which map interned names to the address
+  // of the word's body. Names are looked for in the wordlists of the search
+  // order in turn, first to last, and then among the intrinsics. New words
+  // go in the current wordlist. Names, like labels and the token stream,
+  // are allocated from the program's arena.
+  std::unordered_map<
+    std::string, cell, std::hash<std::string>, std::equal_to<std::string>,
+    arena_allocator<std::pair<const std::string, cell>>> symbols;
+  std::vector<std::string, arena_allocator<std::string>> symbol_names;
+  std::vector<hash_table> wordlists { hash_table { 0 } };
+  std::vector<cell> search_order { forth_wordlist };
+  cell current = forth_wordlist;
+  label_map labels;
+  std::deque<cell> dstack;
+  std::deque<cell> rstack;
+  token_vector token_stream;
+  token_iterator curr_token;
+  std::vector<char> data_space;
+  std::vector<memory_region> regions;
+  cell next_region_base = first_region_base;
+  int input_fd = 0;
+  std::unique_ptr<input_buffer> input_;
+  cell input_base = 0;
+  cell source_addr = 0;
+  cell source_len = 0;
+  const char *text_begin = nullptr;
+  cell text_base = 0;
+  std::vector<std::unique_ptr<file>> files;
+  std::map<cell, size_t> mapped_files;
+  std::unique_ptr<block_file> blocks_;
+  cell blocks_base = 0;
+  cell current_block = -1;
+  std::map<cell, std::unique_ptr<hash_table>> hash_tables;
+  std::vector<std::unique_ptr<bignum>> bignums;
+  std::vector<std::string> extension_paths;
+  std::vector<void(*)(machine_state&)> intrinsic_xts;
+  std::map<std::string, cell> intrinsic_xt_ids;
+  // Address and length of each table, and where each table token's cells
+  // are mapped.
+  std::map<std::string, std::pair<cell, cell>> tables;
+  std::map<const char*, cell> table_bases;
+  cell preload_addr = 0;
+  cell preload_cells = 0;
+  bool speculative = false;
+  // The number of 'catch'es running; errors throw forth_exception when
+  // there are any.
+  int catch_frames = 0;
+  // An error raised by an extension's api call under 'catch', held until
+  // the extension word returns (see extensionWord).
+  std::unique_ptr<forth_exception> extension_error;
+  // How much of the machine debug() prints: the tokens this many either
+  // side of ip, and this many cells of each stack. -1 prints everything.
+  int dump_window = 32;
+  int dump_cells = 32;
+  // 'sort' splits arrays of at least parallel_sort_min cells into
+  // sort_threads runs (0 means one per CPU) and merges them.
+  size_t sort_threads = 0;
+  size_t parallel_sort_min = 1 << 20;
+  // Called with the machine before exiting on an error.
+  std::function<void(const machine_state&)> core_dump;
+
+  // Compile state. While ':' compiles a definition, compiling is false
+  // between '[' and ']', and site is the address of the immediate word
+  // running, which the code it generates replaces.
+  bool compiling = false;
+  int site = -1;
+  std::string last_defined;
+  std::set<std::string> immediates;
+  std::set<int> compiled_defs;
+  std::map<int, std::vector<generated_op>> generated;
+  // Identifiers in compiled words that were resolved when compiled: the
+  // address of a word's body, or an intrinsic's (negative) xt.
+  std::map<int, cell> bound;
+};
+
+bool isBranchTargetToken(const token& tok)
+{
+  return tok.kind == tokens::number ||
+         tok.kind == tokens::identifier;
+}
+
+void branch_to_target(machine_state& m, bool do_branch = true)
+{
+  m.next();
+  m.assert(!m.atEnd() || isBranchTargetToken(*m.curr_token))
+    << "branch word without target.";
+  if (!do_branch) {
+    m.next();
+    return;
+  }
+
+  if (m.curr_token->kind == tokens::number) {
+    m.rbranch(strtol(m.curr_token->start, nullptr, 0));
+    return;
+  }
+
+  auto it = m.labels.find(m.curr_token->to_string());
+  m.assert(it != m.labels.end())
+    << "tried to branch to nonexistent label " << *m.curr_token;
+
+  m.curr_token = it->second;
+}
+
+/*
+ * Bulk memory kernels, shared by the bulk words and by loops that the
+ * optimizer has recognized. Cells in memory need not be aligned, so vectors
+ * are moved in and out with memcpy; the compiler turns that into unaligned
+ * vector loads and stores.
+ */
+typedef cell cell_vec __attribute__((vector_size(16)));
+typedef ucell ucell_vec __attribute__((vector_size(16)));
+constexpr cell cells_per_vec = sizeof(cell_vec) / sizeof(cell);
+constexpr cell unroll = 4;
+
+/*
+ * Replaces each of the n cells at p with op(cell). op is called with either
+ * a cell_vec or a single cell.
+ */
+template<class Op>
+void mapCells(char *p, cell n, Op op)
+{
+  cell i = 0;
+  for (; i + unroll * cells_per_vec <= n; i += unroll * cells_per_vec) {
+    cell_vec v[unroll];
+    memcpy(v, p + i * sizeof(cell), sizeof v);
+    for (auto& x : v) {
+      x = op(x);
+    }
+    memcpy(p + i * sizeof(cell), v, sizeof v);
+  }
+  for (; i < n; ++i) {
+    cell x;
+    memcpy(&x, p + i * sizeof(cell), sizeof x);
+    x = op(x);
+    memcpy(p + i * sizeof(cell), &x, sizeof x);
+  }
+}
+
+/*
+ * The sum of the n cells at p, wrapping on overflow.
+ */
+cell sumCells(const char *p, cell n)
+{
+  ucell_vec acc[unroll] = { };
+  cell i = 0;
+  for (; i + unroll * cells_per_vec <= n; i += unroll * cells_per_vec) {
+    ucell_vec v[unroll];
+    memcpy(v, p + i * sizeof(cell), sizeof v);
+    for (cell j = 0; j < unroll; ++j) {
+      acc[j] += v[j];
+    }
+  }
+  ucell sum = 0;
+  for (auto& v : acc) {
+    for (cell j = 0; j < cells_per_vec; ++j) {
+      sum += v[j];
+    }
+  }
+  for (; i < n; ++i) {
+    ucell x;
+    memcpy(&x, p + i * sizeof(cell), sizeof x);
+    sum += x;
+  }
+  return sum;
+}
+
+/*
+ * Applies x = x <op> k (or k - x for 'r', or k for '=') to n cells at p.
+ */
+void updateCells(char *p, cell n, char op, cell k)
+{
+  switch (op) {
+  case '+': mapCells(p, n, [k](auto x) { return x + k; }); break;
+  case '-': mapCells(p, n, [k](auto x) { return x - k; }); break;
+  case '*': mapCells(p, n, [k](auto x) { return x * k; }); break;
+  case 'r': mapCells(p, n, [k](auto x) { return k - x; }); break;
+  case '=': mapCells(p, n, [k](auto x) { return decltype(x) { } + k; }); break;
+  }
+}
+
+/*
+ * Fills n cells at p with pseudo-random numbers (splitmix64) from the seed.
+ */
+void randomCells(char *p, cell n, uint64_t seed)
+{
+  for (cell i = 0; i < n; ++i) {
+    uint64_t z = (seed += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    z ^= z >> 31;
+    memcpy(p + i * sizeof(cell), &z, sizeof z);
+  }
+}
+
+/*
+ * A fixed set of worker threads, started on first use, that runs batches
+ * of tasks.
+ */
+class thread_pool
+{
+public:
+  static thread_pool& instance()
+  {
+    static thread_pool pool { std::max(1u, std::thread::hardware_concurrency()) };
+    return pool;
+  }
+
+  /*
+   * The number of tasks that can run at once, counting the thread that
+   * calls run().
+   */
+  size_t size() const
+  {
+    return workers.size() + 1;
+  }
+
+  /*
+   * Runs the tasks, helping with them on the calling thread, and returns
+   * once all are done.
+   */
+  void run(std::vector<std::function<void()>>& tasks)
+  {
+    std::unique_lock<std::mutex> lock { mutex };
+    for (auto& t : tasks) {
+      queue.push_back(&t);
+    }
+    pending += tasks.size();
+    work.notify_all();
+    while (pending) {
+      if (!queue.empty()) {
+        runOne(lock);
+      } else {
+        done.wait(lock);
+      }
+    }
+  }
+
+  ~thread_pool()
+  {
+    {
+      std::lock_guard<std::mutex> lock { mutex };
+      stopping = true;
+    }
+    work.notify_all();
+    for (auto& w : workers) {
+      w.join();
+    }
+  }
+
+private:
+  explicit thread_pool(unsigned n)
+  {
+    for (unsigned i = 1; i < n; ++i) {
+      workers.emplace_back([this] {
+        std::unique_lock<std::mutex> lock { mutex };
+        while (true) {
+          work.wait(lock, [this] { return stopping || !queue.empty(); });
+          if (stopping) {
+            return;
+          }
+          runOne(lock);
+        }
+      });
+    }
+  }
+
+  void runOne(std::unique_lock<std::mutex>& lock)
+  {
+    auto task = queue.back();
+    queue.pop_back();
+    lock.unlock();
+    (*task)();
+    lock.lock();
+    if (!--pending) {
+      done.notify_all();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable work;
+  std::condition_variable done;
+  std::vector<std::function<void()>*> queue;
+  size_t pending = 0;
+  bool stopping = false;
+};
+
+constexpr size_t radix_sort_min = 256;
+
+/*
+ * Sorts n signed cells with a least significant digit first radix sort on
+ * bytes, using tmp (also n cells) for scratch. Passes over bytes that are
+ * the same in every cell are skipped.
+ */
+void radixSort(cell *a, cell *tmp, size_t n)
+{
+  if (!n) {
+    return;
+  }
+  constexpr uint64_t sign = 1ull << 63;
+  static thread_local size_t counts[sizeof(cell)][256];
+  memset(counts, 0, sizeof counts);
+  for (size_t i = 0; i < n; ++i) {
+    auto key = (uint64_t)a[i] ^ sign;
+    for (size_t d = 0; d < sizeof(cell); ++d) {
+      ++counts[d][(key >> (8 * d)) & 0xff];
+    }
+  }
+
+  auto src = a, dst = tmp;
+  for (size_t d = 0; d < sizeof(cell); ++d) {
+    auto& c = counts[d];
+    if (c[((uint64_t)a[0] ^ sign) >> (8 * d) & 0xff] == n) {
+      continue;
+    }
+    size_t offset = 0;
+    for (auto& k : c) {
+      auto count = k;
+      k = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < n; ++i) {
+      auto key = (uint64_t)src[i] ^ sign;
+      dst[c[(key >> (8 * d)) & 0xff]++] = src[i];
+    }
+    std::swap(src, dst);
+  }
+  if (src != a) {
+    memcpy(a, src, n * sizeof(cell));
+  }
+}
+
+/*
+ * Merges the sorted runs a[0, na) and b[0, nb) into out with the given
+ * number of tasks, each of which merges a slice of the output. A slice's
+ * inputs are found by binary search along the diagonal where it starts.
+ */
+void addMergeTasks(
+  const cell *a, size_t na, const cell *b, size_t nb, cell *out,
+  size_t parts, std::vector<std::function<void()>>& tasks)
+{
+  auto split = [=](size_t diag) {
+    size_t lo = diag > nb ? diag - nb : 0, hi = std::min(diag, na);
+    while (lo < hi) {
+      auto i = (lo + hi) / 2;
+      if (a[i] <= b[diag - i - 1]) {
+        lo = i + 1;
+      } else {
+        hi = i;
+      }
+    }
+    return lo;
+  };
+  auto n = na + nb;
+  for (size_t p = 0; p < parts; ++p) {
+    auto from = n * p / parts, to = n * (p + 1) / parts;
+    tasks.push_back([=] {
+      auto i = split(from), j = split(to);
+      std::merge(a + i, a + j, b + from - i, b + to - j, out + from);
+    });
+  }
+}
+
+/*
+ * Sorts n cells by radix sorting one chunk per task, then merging pairs of
+ * runs until one is left.
+ */
+void parallelSort(cell *a, cell *tmp, size_t n, size_t parts)
+{
+  auto& pool = thread_pool::instance();
+  std::vector<std::function<void()>> tasks;
+  std::vector<size_t> bounds;
+  for (size_t p = 0; p <= parts; ++p) {
+    bounds.push_back(n * p / parts);
+  }
+  for (size_t p = 0; p < parts; ++p) {
+    auto from = bounds[p], to = bounds[p + 1];
+    tasks.push_back([=] { radixSort(a + from, tmp + from, to - from); });
+  }
+  pool.run(tasks);
+
+  auto src = a, dst = tmp;
+  while (bounds.size() > 2) {
+    auto runs = bounds.size() - 1;
+    std::vector<size_t> merged;
+    tasks.clear();
+    for (size_t r = 0; r < runs; r += 2) {
+      auto from = bounds[r];
+      auto mid = bounds[std::min(r + 1, runs)];
+      auto to = bounds[std::min(r + 2, runs)];
+      addMergeTasks(src + from, mid - from, src + mid, to - mid, dst + from,
+                    std::max<size_t>(1, pool.size() * 2 / runs), tasks);
+      merged.push_back(from);
+    }
+    merged.push_back(n);
+    bounds = std::move(merged);
+    pool.run(tasks);
+    std::swap(src, dst);
+  }
+  if (src != a) {
+    memcpy(a, src, n * sizeof(cell));
+  }
+}
+
+/*
+ * Sorts the n cells at p in ascending order. Unaligned cells are copied out
+ * and back. Arrays of at least parallel_min cells are split into parts
+ * runs (one per pool thread if parts is 0) that are sorted and merged on
+ * the thread pool.
+ */
+void sortCells(char *p, size_t n, size_t parts, size_t parallel_min)
+{
+  if ((uintptr_t)p % alignof(cell)) {
+    std::vector<cell> a(n);
+    memcpy(a.data(), p, n * sizeof(cell));
+    sortCells((char*)a.data(), n, parts, parallel_min);
+    memcpy(p, a.data(), n * sizeof(cell));
+    return;
+  }
+
+  auto a = (cell*)p;
+  if (n < radix_sort_min) {
+    std::sort(a, a + n);
+    return;
+  }
+  std::vector<cell> tmp(n);
+  if (!parts) {
+    parts = thread_pool::instance().size();
+  }
+  if (n >= parallel_min && parts > 1) {
+    parallelSort(a, tmp.data(), n, parts);
+  } else {
+    radixSort(a, tmp.data(), n);
+  }
+}
+
+/*
+ * The index of the first of the n sorted cells at p that is not less than
+ * x.
+ */
+cell lowerBound(const char *p, cell n, cell x)
+{
+  cell lo = 0, hi = n;
+  while (lo < hi) {
+    auto mid = lo + (hi - lo) / 2;
+    cell c;
+    memcpy(&c, p + mid * sizeof(cell), sizeof c);
+    if (c < x) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  return lo;
+}
+
+/*
+ * Instruction set extensions the kernels below can use, detected once at
+ * startup.
+ */
+struct cpu_features
+{
+  bool sse42 = false;
+  bool avx2 = false;
+};
+
+const cpu_features& cpuFeatures()
+{
+  static const cpu_features features = [] {
+    cpu_features f;
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    f.sse42 = __builtin_cpu_supports("sse4.2");
+    f.avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return f;
+  }();
+  return features;
+}
+
+/*
+ * String kernels. Each has a scalar version, plus SSE2 and AVX2 versions on
+ * x86 where AVX2 is picked at run time if the CPU has it.
+ *
+ * search filters candidate positions by comparing the first and last byte
+ * of the needle against a whole vector of positions at once, and only
+ * compares the rest of the needle where both match.
+ */
+struct string_kernels
+{
+  size_t (*count)(const char *p, size_t n, char c);
+  const char *(*search)(const char *h, size_t hn, const char *nd, size_t nn);
+};
+
+size_t countByteScalar(const char *p, size_t n, char c)
+{
+  size_t count = 0;
+  for (size_t i = 0; i < n; ++i) {
+    count += p[i] == c;
+  }
+  return count;
+}
+
+/*
+ * Finds the needle in the haystack. The needle must be at least two bytes
+ * long and no longer than the haystack.
+ */
+const char *searchScalar(const char *h, size_t hn, const char *nd, size_t nn)
+{
+  return (const char*)memmem(h, hn, nd, nn);
+}
+
+#if defined(__x86_64__)
+/*
+ * Counts matches of a vector at a time into byte counters, which are added
+ * up with psadbw before they can overflow.
+ */
+#define COUNT_BYTE_KERNEL(vec, set1, load, cmpeq, sub, sad, zero, lanes)    \
+  auto needle = set1(c);                                                  \
+  size_t count = 0, i = 0;                                                \
+  while (i + sizeof(vec) <= n) {                                          \
+    auto acc = zero();                                                    \
+    for (int k = 0; k < 255 && i + sizeof(vec) <= n;                      \
+         ++k, i += sizeof(vec)) {                                         \
+      acc = sub(acc, cmpeq(load((const vec*)(p + i)), needle));           \
+    }                                                                     \
+    uint64_t sums[lanes];                                                 \
+    auto s = sad(acc, zero());                                            \
+    memcpy(sums, &s, sizeof s);                                           \
+    for (auto x : sums) count += x;                                       \
+  }                                                                       \
+  return count + countByteScalar(p + i, n - i, c);
+
+size_t countByteSse2(const char *p, size_t n, char c)
+{
+  COUNT_BYTE_KERNEL(__m128i, _mm_set1_epi8, _mm_loadu_si128, _mm_cmpeq_epi8,
+                    _mm_sub_epi8, _mm_sad_epu8, _mm_setzero_si128, 2)
+}
+
+__attribute__((target("avx2")))
+size_t countByteAvx2(const char *p, size_t n, char c)
+{
+  COUNT_BYTE_KERNEL(__m256i, _mm256_set1_epi8, _mm256_loadu_si256,
+                    _mm256_cmpeq_epi8, _mm256_sub_epi8, _mm256_sad_epu8,
+                    _mm256_setzero_si256, 4)
+}
+
+#define SEARCH_KERNEL(vec, set1, load, cmpeq, and_, movemask)               \
+  auto first = set1(nd[0]), last = set1(nd[nn - 1]);                      \
+  size_t i = 0;                                                           \
+  for (; i + nn - 1 + sizeof(vec) <= hn; i += sizeof(vec)) {              \
+    auto f = cmpeq(first, load((const vec*)(h + i)));                     \
+    auto l = cmpeq(last, load((const vec*)(h + i + nn - 1)));             \
+    for (unsigned m = movemask(and_(f, l)); m; m &= m - 1) {              \
+      auto at = h + i + __builtin_ctz(m);                                 \
+      if (!memcmp(at + 1, nd + 1, nn - 2)) {                              \
+        return at;                                                        \
+      }                                                                   \
+    }                                                                     \
+  }                                                                       \
+  return searchScalar(h + i, hn - i, nd, nn);
+
+const char *searchSse2(const char *h, size_t hn, const char *nd, size_t nn)
+{
+  SEARCH_KERNEL(__m128i, _mm_set1_epi8, _mm_loadu_si128, _mm_cmpeq_epi8,
+                _mm_and_si128, _mm_movemask_epi8)
+}
+
+__attribute__((target("avx2")))
+const char *searchAvx2(const char *h, size_t hn, const char *nd, size_t nn)
+{
+  SEARCH_KERNEL(__m256i, _mm256_set1_epi8, _mm256_loadu_si256,
+                _mm256_cmpeq_epi8, _mm256_and_si256, _mm256_movemask_epi8)
+}
+
+const string_kernels& stringKernels()
+{
+  static const string_kernels kernels = cpuFeatures().avx2 ?
+    string_kernels { &countByteAvx2, &searchAvx2 } :
+    string_kernels { &countByteSse2, &searchSse2 };
+  return kernels;
+}
+#else
+const string_kernels& stringKernels()
+{
+  static const string_kernels kernels { &countByteScalar, &searchScalar };
+  return kernels;
+}
+#endif
+
+/*
+ * The first occurrence of the needle in the haystack, or null.
+ */
+const char *searchBytes(const char *h, size_t hn, const char *nd, size_t nn)
+{
+  if (nn > hn) {
+    return nullptr;
+  } else if (nn <= 1) {
+    return nn ? (const char*)memchr(h, nd[0], hn) : h;
+  }
+  return stringKernels().search(h, hn, nd, nn);
+}
+
+/*
+ * CRC-32C (Castagnoli), as used by iSCSI, ext4 and others. The table
+ * version processes 8 bytes per step with eight tables ("slicing by 8");
+ * on x86 the SSE4.2 crc32 instruction is used when the CPU has it.
+ */
+struct crc32c_tables
+{
+  uint32_t t[8][256];
+
+  crc32c_tables()
+  {
+    for (uint32_t i = 0; i < 256; ++i) {
+      auto c = i;
+      for (int k = 0; k < 8; ++k) {
+        c = c & 1 ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+      }
+      t[0][i] = c;
+    }
+    for (int k = 1; k < 8; ++k) {
+      for (int i = 0; i < 256; ++i) {
+        t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+uint32_t crc32cTable(uint32_t crc, const char *p, size_t n)
+{
+  static const crc32c_tables tables;
+  auto& t = tables.t;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t x;
+    memcpy(&x, p, sizeof x);
+    x = fromLittleEndian(x) ^ crc;
+    crc = t[7][x & 0xff] ^ t[6][(x >> 8) & 0xff] ^
+          t[5][(x >> 16) & 0xff] ^ t[4][(x >> 24) & 0xff] ^
+          t[3][(x >> 32) & 0xff] ^ t[2][(x >> 40) & 0xff] ^
+          t[1][(x >> 48) & 0xff] ^ t[0][x >> 56];
+  }
+  for (; n; --n, ++p) {
+    crc = (crc >> 8) ^ t[0][(crc ^ (uint8_t)*p) & 0xff];
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+uint32_t crc32cSse42(uint32_t crc, const char *p, size_t n)
+{
+  uint64_t c = crc;
+  for (; n >= 8; n -= 8, p += 8) {
+    uint64_t x;
+    memcpy(&x, p, sizeof x);
+    c = _mm_crc32_u64(c, x);
+  }
+  crc = c;
+  for (; n; --n, ++p) {
+    crc = _mm_crc32_u8(crc, *p);
+  }
+  return crc;
+}
+#endif
+
+uint32_t crc32c(const char *p, size_t n)
+{
+#if defined(__x86_64__)
+  static const auto kernel = cpuFeatures().sse42 ? &crc32cSse42 : &crc32cTable;
+#else
+  static const auto kernel = &crc32cTable;
+#endif
+  return ~kernel(~0u, p, n);
+}
+
+/*
+ * A fast non-cryptographic 64-bit hash, following wyhash (final version 4
+ * with its default secret and a seed of 0): input is mixed 16 or 48 bytes
+ * at a time with 64x64->128 bit multiplications.
+ */
+namespace wyhash {
+
+const uint64_t secret[4] = {
+  0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+  0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull
+};
+
+inline void mum(uint64_t& a, uint64_t& b)
+{
+  auto r = (unsigned __int128)a * b;
+  a = (uint64_t)r;
+  b = (uint64_t)(r >> 64);
+}
+
+inline uint64_t mix(uint64_t a, uint64_t b)
+{
+  mum(a, b);
+  return a ^ b;
+}
+
+inline uint64_t r8(const char *p)
+{
+  uint64_t x;
+  memcpy(&x, p, sizeof x);
+  return fromLittleEndian(x);
+}
+
+inline uint64_t r4(const char *p)
+{
+  uint32_t x;
+  memcpy(&x, p, sizeof x);
+  return fromLittleEndian(x);
+}
+
+inline uint64_t r3(const char *p, size_t n)
+{
+  return ((uint64_t)(uint8_t)p[0] << 16) |
+         ((uint64_t)(uint8_t)p[n >> 1] << 8) | (uint8_t)p[n - 1];
+}
+
+uint64_t bytes(const char *p, size_t n)
+{
+  uint64_t seed = mix(secret[0], secret[1]), a, b;
+  if (n <= 16) {
+    if (n >= 4) {
+      auto d = (n >> 3) << 2;
+      a = (r4(p) << 32) | r4(p + d);
+      b = (r4(p + n - 4) << 32) | r4(p + n - 4 - d);
+    } else {
+      a = n ? r3(p, n) : 0;
+      b = 0;
+    }
+  } else {
+    auto i = n;
+    if (i > 48) {
+      auto see1 = seed, see2 = seed;
+      do {
+        seed = mix(r8(p) ^ secret[1], r8(p + 8) ^ seed);
+        see1 = mix(r8(p + 16) ^ secret[2], r8(p + 24) ^ see1);
+        see2 = mix(r8(p + 32) ^ secret[3], r8(p + 40) ^ see2);
+        p += 48;
+        i -= 48;
+      } while (i > 48);
+      seed ^= see1 ^ see2;
+    }
+    for (; i > 16; i -= 16, p += 16) {
+      seed = mix(r8(p) ^ secret[1], r8(p + 8) ^ seed);
+    }
+    a = r8(p + i - 16);
+    b = r8(p + i - 8);
+  }
+  a ^= secret[1];
+  b ^= seed;
+  mum(a, b);
+  return mix(a ^ secret[0] ^ n, b ^ secret[1]);
+}
+
+/*
+ * wyhash64: hashes a single cell without going through memory.
+ */
+uint64_t cell(uint64_t x)
+{
+  uint64_t y = 0;
+  x ^= secret[0];
+  y ^= secret[1];
+  mum(x, y);
+  return mix(x ^ secret[0], y ^ secret[1]);
+}
+
+}
+
+/*
+ * big+, big- and big*: ( h1 h2 -- h3 )
+ */
+template<char op>
+void bignumOp(machine_state& m)
+{
+  auto& b = m.bignum_at(m.pop());
+  auto& a = m.bignum_at(m.pop());
+  m.push(m.new_bignum(op == '+' ? a + b : op == '-' ? a - b : a * b));
+  m.next();
+}
+
+void doLoop(machine_state& m)
+{
+  auto start = m.pop();
+  auto limit = m.pop();
+  m.next();
+  m.rpush(m.ip());
+  m.rpush(limit);
+  m.rpush(start);
+}
+
+/*
+ * open-file and create-file: ( c-addr u fam -- fileid ior )
+ */
+template<int flags>
+void openFile(machine_state& m)
+{
+  auto fam = m.pop();
+  auto u = m.pop();
+  std::string name { m.mem(m.pop(), u), (size_t)u };
+  auto fd = open(name.c_str(), (fam & O_ACCMODE) | flags | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    m.push(0);
+    m.push(iorFromErrno());
+  } else {
+    size_t slot = 0;
+    while (slot < m.files.size() && m.files[slot]) {
+      ++slot;
+    }
+    if (slot == m.files.size()) {
+      m.files.emplace_back();
+    }
+    m.files[slot].reset(new file { fd, (int)fam });
+    m.push(slot + 1);
+    m.push(ior_ok);
+  }
+  m.next();
+}
+
+/*
+ * map-file and map-file-private: ( c-addr u -- addr len ior )
+ */
+template<bool copy_on_write>
+void mapFile(machine_state& m)
+{
+  auto u = m.pop();
+  std::string name { m.mem(m.pop(), u), (size_t)u };
+  cell addr = 0, len = 0;
+  auto ior = m.map_file(name, copy_on_write, addr, len);
+  m.push(addr);
+  m.push(len);
+  m.push(ior);
+  m.next();
+}
+
+/*
+ * Moves n cells between memory and a file, four or eight bytes per cell
+ * in little-endian order.
+ */
+template<size_t width>
+cell readCells(machine_state& m, file& f, char *dest, cell n)
+{
+  static_assert(width == 4 || width == 8, "unsupported cell width");
+  // Narrow values are read into the back half of the destination and
+  // widened front to back, which never overwrites a value still to be read.
+  auto raw = dest + n * (sizeof(cell) - width);
+  auto got = f.read(raw, n * width);
+  n = std::max<ssize_t>(got, 0) / width;
+  for (cell i = 0; i < n; ++i) {
+    typename std::conditional<width == 4, int32_t, int64_t>::type v;
+    memcpy(&v, raw + i * width, width);
+    cell c = fromLittleEndian(v);
+    memcpy(dest + i * sizeof(cell), &c, sizeof(cell));
+  }
+  return n;
+}
+
+template<size_t width>
+cell writeCells(machine_state& m, file& f, const char *src, cell n)
+{
+  static_assert(width == 4 || width == 8, "unsupported cell width");
+  if (width == sizeof(cell) && isLittleEndian()) {
+    return f.write(src, n * width) == ior_ok ? n : 0;
+  }
+  char buf[1 << 16];
+  constexpr cell chunk = sizeof(buf) / width;
+  for (cell done = 0; done < n; done += chunk) {
+    auto count = std::min(chunk, n - done);
+    for (cell i = 0; i < count; ++i) {
+      cell c;
+      memcpy(&c, src + (done + i) * sizeof(cell), sizeof(cell));
+      typename std::conditional<width == 4, int32_t, int64_t>::type v = c;
+      v = fromLittleEndian(v);
+      memcpy(buf + i * width, &v, width);
+    }
+    if (f.write(buf, count * width) != ior_ok) {
+      return done;
+    }
+  }
+  return n;
+}
+
+/*
+ * read-cells, read-cells32, write-cells and write-cells32:
+ * ( addr n id -- n' ). n' is less than n at end of file or on error.
+ */
+template<size_t width, bool write>
+void transferCells(machine_state& m)
+{
+  auto f = m.fileById(m.pop());
+  auto n = std::max<cell>(m.pop(), 0);
+  auto p = m.mem_cells(m.pop(), n, !write);
+  if (!f) {
+    m.push(0);
+  } else if (write) {
+    m.push(writeCells<width>(m, *f, p, n));
+  } else {
+    m.push(readCells<width>(m, *f, p, n));
+  }
+  m.next();
+}
+
+cell nowNs(clockid_t clock = CLOCK_MONOTONIC)
+{
+  timespec ts;
+  clock_gettime(clock, &ts);
+  return (cell)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/*
+ * The CPU's timestamp counter, read once all earlier instructions have
+ * finished. Other CPUs count nanoseconds instead.
+ */
+cell cycleCount()
+{
+#if defined(__x86_64__) || defined(__i386__)
+  _mm_lfence();
+  cell c = __rdtsc();
+  _mm_lfence();
+  return c;
+#else
+  return nowNs();
+#endif
+}
+
+/*
+ * bench: ( xt n -- ns ). Runs the word about n times and returns the time
+ * per run in nanoseconds. The runs are split into batches after a warmup;
+ * the fastest and slowest quarter of the batches are discarded and the
+ * rest averaged.
+ */
+void benchWord(machine_state& m)
+{
+  static constexpr cell batches = 16;
+  auto n = m.pop();
+  auto xt = m.pop();
+  m.assert(n > 0) << "bench needs a positive count";
+
+  auto depth = m.dstack.size();
+  for (cell i = 0; i < n / 10 + 1; ++i) {
+    m.execute_nested(xt);
+  }
+  m.assert(m.dstack.size() == depth)
+    << "benchmarked words must leave the stack depth unchanged";
+
+  auto count = std::min(n, batches);
+  auto per_batch = (n + count - 1) / count;
+  std::vector<double> times;
+  for (cell b = 0; b < count; ++b) {
+    auto start = nowNs();
+    for (cell i = 0; i < per_batch; ++i) {
+      m.execute_nested(xt);
+    }
+    times.push_back((double)(nowNs() - start) / per_batch);
+  }
+  std::sort(times.begin(), times.end());
+  auto drop = count / 4;
+  double sum = 0;
+  for (auto i = drop; i < count - drop; ++i) {
+    sum += times[i];
+  }
+  m.push((cell)(sum / (count - 2 * drop) + 0.5));
+  m.next();
+}
+
+/*
+ * map-sequential and map-random: ( addr len -- ior )
+ */
+template<int advice>
+void adviseMapping(machine_state& m)
+{
+  auto len = m.pop();
+  auto p = m.mem(m.pop(), len);
+  auto page = (uintptr_t)sysconf(_SC_PAGESIZE);
+  auto start = (uintptr_t)p & ~(page - 1);
+  m.push(madvise((void*)start, (uintptr_t)p + len - start, advice) < 0 ?
+         iorFromErrno() : ior_ok);
+  m.next();
+}
+
+void loadExtension(machine_state& m);
+
+std::map<std::string, void(*)(machine_state&)> intrinsics {
+  {
+    "dup",
+    [](machine_state& m) {
+      m.push(m.top());
+      m.next();
+    },
+  },
+  {
+    "swap",
+    [](machine_state& m) {
+      auto b = m.pop();
+      auto a = m.pop();
+      m.push(b);
+      m.push(a);
+      m.next();
+    }
+  },
+  {
+    "over",
+    [](machine_state& m) {
+      auto b = m.pop();
+      auto a = m.pop();
+      m.push(a);
+      m.push(b);
+      m.push(a);
+      m.next();
+    }
+  },
+  {
+    "rot",
+    [](machine_state& m) {
+      auto c = m.pop();
+      auto b = m.pop();
+      auto a = m.pop();
+      m.push(b);
+      m.push(c);
+      m.push(a);
+      m.next();
+    }
+  },
+  {
+    "drop",
+    [](machine_state& m) {
+      (void)m.pop();
+      m.next();
+    }
+  },
+  {
+    "clear",
+    [](machine_state& m) {
+      m.dstack.clear();
+      m.next();
+    }
+  },
+  {
+    "if",
+    [](machine_state& m) {
+      if (!m.pop()) {
+        m.next();
+        int counter = 0;
+        auto pred = [&counter](const token& tok) {
+          if (counter == 0 &&
+            (isTokenWithId("else", tok) || isTokenWithId("then", tok))) {
+            return true;
+          }
+
+          if (isTokenWithId("if", tok)) {
+            ++counter;
+          }
+          if (counter && isTokenWithId("then", tok)) {
+            --counter;
+          }
+          return false;
+        };
+        if (!m.branchTo(pred)) {
+          m.error() << "'if' with no corresponding 'then'";
+        }
+      }
+      m.next();
+    }
+  },
+  {
+    "else",
+    [](machine_state& m) {
+      int counter = 0;
+      m.next();
+      auto pred = [&counter](const token& tok) {
+        if (counter == 0 && isTokenWithId("then", tok)) {
+          return true;
+        }
+        if (isTokenWithId("if", tok)) {
+          ++counter;
+        }
+        if (isTokenWithId("then", tok)) {
+          --counter;
+        }
+        return false;
+      };
+      if (!m.branchTo(pred)) {
+        m.error() << "'else' with no corresponding 'then'";
+      }
+      m.next();
+    }
+  },
+  {
+    "then",
+    [](machine_state& m) { m.next(); }
+  },
+  {
+    "branch",
+    [](machine_state& m) {
+      branch_to_target(m);
+    }
+  },
+  {
+    "?branch",
+    [](machine_state& m) {
+      branch_to_target(m, m.pop() != 0);
+    }
+  },
+  {
+    "'",
+    [](machine_state& m) {
+      m.next();
+      m.assert(!m.atEnd() && (m.curr_token->kind == tokens::identifier ||
+                              m.curr_token->kind == tokens::operation))
+        << "expecting identifier";
+      m.push(m.xt(m.curr_token->to_string()));
+      m.next();
+    }
+  },
+  {
+    "load-extension",
+    &loadExtension
+  },
+  {
+    "execute",
+    [](machine_state& m) {
+      m.execute(m.pop());
+    }
+  },
+  {
+    "forth-wordlist",
+    [](machine_state& m) {
+      m.push(machine_state::forth_wordlist);
+      m.next();
+    }
+  },
+  {
+    "wordlist",
+    [](machine_state& m) {
+      m.wordlists.emplace_back(0);
+      m.push(m.wordlists.size() - 1);
+      m.next();
+    }
+  },
+  {
+    "get-order",
+    [](machine_state& m) {
+      for (auto it = m.search_order.rbegin(); it != m.search_order.rend(); ++it) {
+        m.push(*it);
+      }
+      m.push(m.search_order.size());
+      m.next();
+    }
+  },
+  {
+    "set-order",
+    [](machine_state& m) {
+      auto n = m.pop();
+      if (n == -1) {
+        m.search_order = { machine_state::forth_wordlist };
+      } else {
+        m.assert(n >= 0 && n <= (cell)m.dstack.size())
+          << "invalid search order size " << n;
+        std::vector<cell> order;
+        while (n--) {
+          order.push_back(m.wordlist_arg(m.pop()));
+        }
+        m.search_order = std::move(order);
+      }
+      m.next();
+    }
+  },
+  {
+    "get-current",
+    [](machine_state& m) {
+      m.push(m.current);
+      m.next();
+    }
+  },
+  {
+    "set-current",
+    [](machine_state& m) {
+      m.current = m.wordlist_arg(m.pop());
+      m.next();
+    }
+  },
+  {
+    "definitions",
+    [](machine_state& m) {
+      m.assert(!m.search_order.empty()) << "the search order is empty";
+      m.current = m.search_order.front();
+      m.next();
+    }
+  },
+  {
+    "also",
+    [](machine_state& m) {
+      m.assert(!m.search_order.empty()) << "the search order is empty";
+      m.search_order.insert(m.search_order.begin(), m.search_order.front());
+      m.next();
+    }
+  },
+  {
+    "only",
+    [](machine_state& m) {
+      m.search_order = { machine_state::forth_wordlist };
+      m.next();
+    }
+  },
+  {
+    "previous",
+    [](machine_state& m) {
+      m.assert(!m.search_order.empty()) << "the search order is empty";
+      m.search_order.erase(m.search_order.begin());
+      m.next();
+    }
+  },
+  {
+    "immediate",
+    [](machine_state& m) {
+      m.assert(!m.last_defined.empty()) << "no word to make immediate";
+      m.immediates.insert(m.last_defined);
+      m.next();
+    }
+  },
+  {
+    "[",
+    [](machine_state& m) {
+      // Compiled words skip what ran when they were defined.
+      m.next();
+      m.assert(m.branchTo("]")) << "'[' without ']'";
+      m.next();
+    }
+  },
+  {
+    "]",
+    [](machine_state& m) {
+      m.error() << "']' without '['";
+    }
+  },
+  {
+    "literal",
+    [](machine_state& m) {
+      m.assert(m.site >= 0) << "literal outside of a definition";
+      m.generated[m.site].push_back(generated_op { false, m.pop() });
+      m.next();
+    }
+  },
+  {
+    "postpone",
+    [](machine_state& m) {
+      m.next();
+      m.assert(!m.atEnd() && (m.curr_token->kind == tokens::identifier ||
+                              m.curr_token->kind == tokens::operation))
+        << "postpone needs a word name";
+      m.assert(m.site >= 0) << "postpone outside of a definition";
+      if (m.is_immediate(*m.curr_token)) {
+        m.run_token();
+      } else {
+        m.generated[m.site].push_back(generated_op { true, m.ip() });
+        m.next();
+      }
+    }
+  },
+  {
+    "[char]",
+    [](machine_state& m) {
+      m.next();
+      m.assert(!m.atEnd()) << "[char] needs a character";
+      m.push((unsigned char)*m.curr_token->start);
+      m.next();
+    }
+  },
+  {
+    "catch",
+    [](machine_state& m) {
+      auto xt = m.pop();
+      auto here = m.curr_token;
+      auto depth = m.dstack.size();
+      auto rdepth = m.rstack.size();
+      cell code = 0;
+      ++m.catch_frames;
+      try {
+        m.execute_nested(xt);
+      } catch (const forth_exception& e) {
+        code = e.code;
+        m.curr_token = here;
+        m.dstack.resize(depth);
+        m.rstack.resize(rdepth);
+      }
+      --m.catch_frames;
+      m.push(code);
+      m.next();
+    }
+  },
+  {
+    "throw",
+    [](machine_state& m) {
+      auto code = m.pop();
+      if (code) {
+        m.error(code) << "uncaught exception " << code;
+      }
+      m.next();
+    }
+  },
+  {
+    "bench",
+    &benchWord
+  },
+  {
+    "utime",
+    [](machine_state& m) {
+      m.push(nowNs(CLOCK_REALTIME) / 1000);
+      m.next();
+    }
+  },
+  {
+    "ntime",
+    [](machine_state& m) {
+      m.push(nowNs());
+      m.next();
+    }
+  },
+  {
+    "cycles",
+    [](machine_state& m) {
+      m.push(cycleCount());
+      m.next();
+    }
+  },
+  {
+    ">r",
+    [](machine_state& m) {
+      m.rpush(m.pop());
+      m.next();
+    }
+  },
+  {
+    "r>",
+    [](machine_state& m) {
+      m.push(m.rpop());
+      m.next();
+    }
+  },
+  {
+    "r@",
+    [](machine_state& m) {
+      m.push(m.rtop());
+      m.next();
+    }
+  },
+  {
+    "rdrop",
+    [](machine_state& m) {
+      m.rpop();
+      m.next();
+    }
+  },
+  {
+    "rclear",
+    [](machine_state& m) {
+      m.rstack.clear();
+      m.next();
+    }
+  },
+  {
+    "do",
+    &doLoop
+  },
+  {
+    "loop",
+    [](machine_state& m) {
+      m.assert(m.rstack.size() >= 3) << "'loop' without 'do'";
+      auto index = m.rpop() + 1;
+      auto limit = m.rpop();
+      if (index < limit) {
+        m.rpush(limit);
+        m.rpush(index);
+        m.abranch(m.rstack[m.rstack.size() - 3]);
+        return;
+      }
+      m.rpop();
+      m.next();
+    }
+  },
+  {
+    "i",
+    [](machine_state& m) {
+      m.push(m.rtop());
+      m.next();
+    }
+  },
+  {
+    "j",
+    [](machine_state& m) {
+      m.assert(m.rstack.size() >= 6) << "'j' outside of a nested loop";
+      m.push(m.rstack[m.rstack.size() - 4]);
+      m.next();
+    }
+  },
+  {
+    "here",
+    [](machine_state& m) {
+      m.push(m.here());
+      m.next();
+    }
+  },
+  {
+    "allot",
+    [](machine_state& m) {
+      auto n = m.pop();
+      auto size = (cell)m.data_space.size() + n;
+      m.assert(size >= 0 && size <= machine_state::max_data_space)
+        << "can't resize data space to " << size << " bytes";
+      m.data_space.resize(size);
+      m.next();
+    }
+  },
+  {
+    "cells",
+    [](machine_state& m) {
+      m.push(m.pop() * sizeof(cell));
+      m.next();
+    }
+  },
+  {
+    "@",
+    [](machine_state& m) {
+      m.push(m.fetch(m.pop()));
+      m.next();
+    }
+  },
+  {
+    "store",
+    [](machine_state& m) {
+      auto addr = m.pop();
+      m.store(addr, m.pop());
+      m.next();
+    }
+  },
+  {
+    "c@",
+    [](machine_state& m) {
+      m.push((unsigned char)*m.mem(m.pop(), 1));
+      m.next();
+    }
+  },
+  {
+    "c!",
+    [](machine_state& m) {
+      auto addr = m.pop();
+      *m.mem(addr, 1, true) = (char)m.pop();
+      m.next();
+    }
+  },
+  {
+    "fill-cells",
+    [](machine_state& m) {
+      auto k = m.pop();
+      auto n = m.pop();
+      auto addr = m.pop();
+      updateCells(m.mem_cells(addr, n, true), n, '=', k);
+      m.next();
+    }
+  },
+  {
+    "add-cells",
+    [](machine_state& m) {
+      auto k = m.pop();
+      auto n = m.pop();
+      auto addr = m.pop();
+      updateCells(m.mem_cells(addr, n, true), n, '+', k);
+      m.next();
+    }
+  },
+  {
+    "sum-cells",
+    [](machine_state& m) {
+      auto n = m.pop();
+      auto addr = m.pop();
+      m.push(sumCells(m.mem_cells(addr, n), n));
+      m.next();
+    }
+  },
+  {
+    "fill-random",
+    [](machine_state& m) {
+      auto seed = m.pop();
+      auto n = std::max<cell>(m.pop(), 0);
+      randomCells(m.mem_cells(m.pop(), n, true), n, seed);
+      m.next();
+    }
+  },
+  {
+    "sort",
+    [](machine_state& m) {
+      auto n = std::max<cell>(m.pop(), 0);
+      sortCells(m.mem_cells(m.pop(), n, true), n, m.sort_threads,
+                m.parallel_sort_min);
+      m.next();
+    }
+  },
+  {
+    "sort-by",
+    [](machine_state& m) {
+      auto xt = m.pop();
+      auto n = std::max<cell>(m.pop(), 0);
+      auto addr = m.pop();
+      auto p = m.mem_cells(addr, n);
+      std::vector<cell> a(n);
+      memcpy(a.data(), p, n * sizeof(cell));
+      // The comparator may change memory, so the cells are sorted in a copy.
+      std::stable_sort(a.begin(), a.end(), [&](cell x, cell y) {
+        m.push(x);
+        m.push(y);
+        m.execute_nested(xt);
+        return m.pop() != 0;
+      });
+      memcpy(m.mem_cells(addr, n, true), a.data(), n * sizeof(cell));
+      m.next();
+    }
+  },
+  {
+    "lower-bound",
+    [](machine_state& m) {
+      auto x = m.pop();
+      auto n = std::max<cell>(m.pop(), 0);
+      m.push(lowerBound(m.mem_cells(m.pop(), n), n, x));
+      m.next();
+    }
+  },
+  {
+    "bsearch",
+    [](machine_state& m) {
+      auto x = m.pop();
+      auto n = std::max<cell>(m.pop(), 0);
+      auto p = m.mem_cells(m.pop(), n);
+      auto i = lowerBound(p, n, x);
+      cell c = 0;
+      if (i < n) {
+        memcpy(&c, p + i * sizeof(cell), sizeof c);
+      }
+      m.push(i);
+      m.push(i < n && c == x);
+      m.next();
+    }
+  },
+  {
+    "search",
+    [](machine_state& m) {
+      auto u2 = std::max<cell>(m.pop(), 0);
+      auto nd = m.mem(m.pop(), u2);
+      auto u1 = std::max<cell>(m.pop(), 0);
+      auto a1 = m.pop();
+      auto h = m.mem(a1, u1);
+      auto at = searchBytes(h, u1, nd, u2);
+      m.push(at ? a1 + (at - h) : a1);
+      m.push(at ? u1 - (at - h) : u1);
+      m.push(at != nullptr);
+      m.next();
+    }
+  },
+  {
+    "scan",
+    [](machine_state& m) {
+      char c = m.pop();
+      auto u = std::max<cell>(m.pop(), 0);
+      auto addr = m.pop();
+      auto p = m.mem(addr, u);
+      auto at = (const char*)memchr(p, c, u);
+      auto off = at ? at - p : u;
+      m.push(addr + off);
+      m.push(u - off);
+      m.next();
+    }
+  },
+  {
+    "count-char",
+    [](machine_state& m) {
+      char c = m.pop();
+      auto u = std::max<cell>(m.pop(), 0);
+      m.push(stringKernels().count(m.mem(m.pop(), u), u, c));
+      m.next();
+    }
+  },
+  {
+    "str=",
+    [](machine_state& m) {
+      auto u2 = std::max<cell>(m.pop(), 0);
+      auto p2 = m.mem(m.pop(), u2);
+      auto u1 = std::max<cell>(m.pop(), 0);
+      auto p1 = m.mem(m.pop(), u1);
+      m.push(u1 == u2 && !memcmp(p1, p2, u1));
+      m.next();
+    }
+  },
+  {
+    "compare",
+    [](machine_state& m) {
+      auto u2 = std::max<cell>(m.pop(), 0);
+      auto p2 = m.mem(m.pop(), u2);
+      auto u1 = std::max<cell>(m.pop(), 0);
+      auto p1 = m.mem(m.pop(), u1);
+      auto r = memcmp(p1, p2, std::min(u1, u2));
+      if (!r) {
+        r = (u1 > u2) - (u1 < u2);
+      }
+      m.push((r > 0) - (r < 0));
+      m.next();
+    }
+  },
+  {
+    "crc32c",
+    [](machine_state& m) {
+      auto u = std::max<cell>(m.pop(), 0);
+      m.push(crc32c(m.mem(m.pop(), u), u));
+      m.next();
+    }
+  },
+  {
+    "hash-bytes",
+    [](machine_state& m) {
+      auto u = std::max<cell>(m.pop(), 0);
+      m.push(wyhash::bytes(m.mem(m.pop(), u), u));
+      m.next();
+    }
+  },
+  {
+    "hash-cell",
+    [](machine_state& m) {
+      m.push(wyhash::cell(m.pop()));
+      m.next();
+    }
+  },
+  {
+    ">big",
+    [](machine_state& m) {
+      m.push(m.new_bignum(bignum::fromCell(m.pop())));
+      m.next();
+    }
+  },
+  {
+    "big+",
+    &bignumOp<'+'>
+  },
+  {
+    "big-",
+    &bignumOp<'-'>
+  },
+  {
+    "big*",
+    &bignumOp<'*'>
+  },
+  {
+    "big/mod",
+    [](machine_state& m) {
+      auto& b = m.bignum_at(m.pop());
+      auto& a = m.bignum_at(m.pop());
+      m.assert(!b.mag.empty(), throw_division_by_zero) << "division by zero";
+      bignum q, r;
+      bignum::divMod(a, b, q, r);
+      m.push(m.new_bignum(std::move(r)));
+      m.push(m.new_bignum(std::move(q)));
+      m.next();
+    }
+  },
+  {
+    "big.",
+    [](machine_state& m) {
+      output.write(m.bignum_at(m.pop()).to_string());
+      output.put('\n');
+      m.next();
+    }
+  },
+  {
+    "big-free",
+    [](machine_state& m) {
+      auto h = m.pop();
+      m.bignum_at(h);
+      m.bignums[h - 1].reset();
+      m.next();
+    }
+  },
+  {
+    "base",
+    [](machine_state& m) {
+      m.push(machine_state::base_addr);
+      m.next();
+    }
+  },
+  {
+    "hex",
+    [](machine_state& m) {
+      m.store(machine_state::base_addr, 16);
+      m.next();
+    }
+  },
+  {
+    "decimal",
+    [](machine_state& m) {
+      m.store(machine_state::base_addr, 10);
+      m.next();
+    }
+  },
+  {
+    "u.",
+    [](machine_state& m) {
+      output.number(m.pop(), m.base(), 0, false);
+      output.put('\n');
+      m.next();
+    }
+  },
+  {
+    ".r",
+    [](machine_state& m) {
+      auto width = m.pop();
+      output.number(m.pop(), m.base(), std::max<cell>(width, 0));
+      m.next();
+    }
+  },
+  {
+    "key",
+    [](machine_state& m) {
+      m.push(m.input().key());
+      m.sync_input();
+      m.next();
+    }
+  },
+  {
+    "accept",
+    [](machine_state& m) {
+      auto u = m.pop();
+      auto addr = m.pop();
+      auto dest = m.mem(addr, std::max<cell>(u, 0), true);
+      const char *p;
+      size_t n = 0;
+      if (m.input().line(p, n)) {
+        n = std::min(n, (size_t)std::max<cell>(u, 0));
+        memcpy(dest, p, n);
+      }
+      m.sync_input();
+      m.push(n);
+      m.next();
+    }
+  },
+  {
+    "read-line",
+    [](machine_state& m) {
+      auto u = m.pop();
+      auto addr = m.pop();
+      auto dest = m.mem(addr, std::max<cell>(u, 0), true);
+      const char *p;
+      size_t n = 0;
+      bool found = m.input().line(p, n, std::max<cell>(u, 0));
+      if (found) {
+        memcpy(dest, p, n);
+      }
+      m.sync_input();
+      m.push(n);
+      m.push(found);
+      m.next();
+    }
+  },
+  {
+    "refill",
+    [](machine_state& m) {
+      const char *p;
+      size_t n = 0;
+      bool found = m.input().line(p, n);
+      m.sync_input();
+      m.source_addr = found ? m.input_addr(p) : 0;
+      m.source_len = n;
+      m.push(found);
+      m.next();
+    }
+  },
+  {
+    "source",
+    [](machine_state& m) {
+      m.push(m.source_addr);
+      m.push(m.source_len);
+      m.next();
+    }
+  },
+  {
+    "type",
+    [](machine_state& m) {
+      auto n = m.pop();
+      output.write(m.mem(m.pop(), n), n);
+      m.next();
+    }
+  },
+  {
+    "r/o",
+    [](machine_state& m) {
+      m.push(O_RDONLY);
+      m.next();
+    }
+  },
+  {
+    "w/o",
+    [](machine_state& m) {
+      m.push(O_WRONLY);
+      m.next();
+    }
+  },
+  {
+    "r/w",
+    [](machine_state& m) {
+      m.push(O_RDWR);
+      m.next();
+    }
+  },
+  {
+    "open-file",
+    &openFile<0>
+  },
+  {
+    "create-file",
+    &openFile<O_CREAT | O_TRUNC>
+  },
+  {
+    "close-file",
+    [](machine_state& m) {
+      auto id = m.pop();
+      auto f = m.fileById(id);
+      m.push(f ? f->close() : ior_file_io);
+      if (f) {
+        m.files[id - 1].reset();
+      }
+      m.next();
+    }
+  },
+  {
+    "read-file",
+    [](machine_state& m) {
+      auto f = m.fileById(m.pop());
+      auto u = m.pop();
+      auto dest = m.mem(m.pop(), u, true);
+      if (!f) {
+        m.push(0);
+        m.push(ior_file_io);
+      } else {
+        auto n = f->read(dest, u);
+        m.push(std::max<cell>(n, 0));
+        m.push(n < 0 ? iorFromErrno() : ior_ok);
+      }
+      m.next();
+    }
+  },
+  {
+    "write-file",
+    [](machine_state& m) {
+      auto f = m.fileById(m.pop());
+      auto u = m.pop();
+      auto src = m.mem(m.pop(), u);
+      m.push(f ? f->write(src, u) : ior_file_io);
+      m.next();
+    }
+  },
+  {
+    "file-size",
+    [](machine_state& m) {
+      auto f = m.fileById(m.pop());
+      struct stat st;
+      if (!f) {
+        m.push(0);
+        m.push(ior_file_io);
+      } else if (f->flush() != ior_ok || fstat(f->fd, &st) < 0) {
+        m.push(0);
+        m.push(iorFromErrno());
+      } else {
+        m.push(st.st_size);
+        m.push(ior_ok);
+      }
+      m.next();
+    }
+  },
+  {
+    "map-file",
+    &mapFile<false>
+  },
+  {
+    "map-file-private",
+    &mapFile<true>
+  },
+  {
+    "unmap",
+    [](machine_state& m) {
+      auto len = m.pop();
+      auto addr = m.pop();
+      auto it = m.mapped_files.find(addr);
+      if (!addr && !len) {
+        m.push(ior_ok);
+      } else if (it == m.mapped_files.end() || (size_t)len != it->second) {
+        m.push(ior_file_io);
+      } else {
+        munmap(m.translate(addr, len), len);
+        m.unmap_region(addr);
+        m.mapped_files.erase(it);
+        m.push(ior_ok);
+      }
+      m.next();
+    }
+  },
+  {
+    "read-cells",
+    &transferCells<8, false>
+  },
+  {
+    "read-cells32",
+    &transferCells<4, false>
+  },
+  {
+    "write-cells",
+    &transferCells<8, true>
+  },
+  {
+    "write-cells32",
+    &transferCells<4, true>
+  },
+  {
+    "preloaded",
+    [](machine_state& m) {
+      m.push(m.preload_addr);
+      m.push(m.preload_cells);
+      m.next();
+    }
+  },
+  {
+    "open-blocks",
+    [](machine_state& m) {
+      auto u = m.pop();
+      std::string name { m.mem(m.pop(), u), (size_t)u };
+      m.push(m.open_blocks(name));
+      m.next();
+    }
+  },
+  {
+    "block",
+    [](machine_state& m) {
+      m.push(m.block(m.pop()));
+      m.next();
+    }
+  },
+  {
+    // Blocks are mapped, so there is no read to skip.
+    "buffer",
+    [](machine_state& m) {
+      m.push(m.block(m.pop()));
+      m.next();
+    }
+  },
+  {
+    "update",
+    [](machine_state& m) {
+      m.assert(m.current_block >= 0) << "no current block";
+      m.blocks().dirty.insert(m.current_block);
+      m.next();
+    }
+  },
+  {
+    "flush",
+    [](machine_state& m) {
+      // Like standard FLUSH, does nothing without a block file.
+      m.assert(!m.blocks_ || m.blocks_->flush() == ior_ok)
+        << "couldn't flush blocks";
+      m.next();
+    }
+  },
+  {
+    "hashtable",
+    [](machine_state& m) {
+      m.push(m.new_hash_table(m.pop()));
+      m.next();
+    }
+  },
+  {
+    "ht@",
+    [](machine_state& m) {
+      auto& t = m.hash_table_at(m.pop());
+      auto i = t.find(m.pop());
+      m.push(i < 0 ? 0 : t.values()[i]);
+      m.push(i >= 0);
+      m.next();
+    }
+  },
+  {
+    "ht!",
+    [](machine_state& m) {
+      auto ht = m.pop();
+      auto key = m.pop();
+      if (m.hash_table_at(ht).insert(key, m.pop())) {
+        m.sync_hash_table(ht);
+      }
+      m.next();
+    }
+  },
+  {
+    "ht-delete",
+    [](machine_state& m) {
+      auto& t = m.hash_table_at(m.pop());
+      m.push(t.erase(m.pop()));
+      m.next();
+    }
+  },
+  {
+    "ht-count",
+    [](machine_state& m) {
+      m.push(m.hash_table_at(m.pop()).count());
+      m.next();
+    }
+  },
+  {
+    "map-sequential",
+    &adviseMapping<MADV_SEQUENTIAL>
+  },
+  {
+    "map-random",
+    &adviseMapping<MADV_RANDOM>
+  },
+  {
+    "cr",
+    [](machine_state& m) {
+      output.put('\n');
+      m.next();
+    }
+  },
+  {
+    "exit",
     [](machine_state& m) {
-      std::cout << std::endl;
+      m.exit();
+    }
+  },
+};
+
+/*
+ * Operators. Each one is its own intrinsic, instantiated from a kernel for
+ * its functor, and operator tokens are bound to it when they are lexed.
+ */
+template<class Op>
+void binaryOp(machine_state& m)
+{
+  auto r = m.pop();
+  auto l = m.pop();
+  m.push(Op { }(l, r));
+  m.next();
+}
+
+template<class Op>
+void divisionOp(machine_state& m)
+{
+  auto r = m.pop();
+  auto l = m.pop();
+  m.assert(r != 0, throw_division_by_zero) << "division by zero";
+  m.assert(r != -1 || l != std::numeric_limits<cell>::min(),
+           throw_out_of_range) << "division overflow";
+  m.push(Op { }(l, r));
+  m.next();
+}
+
+void logicalNot(machine_state& m)
+{
+  m.push(!m.pop());
+  m.next();
+}
+
+const std::map<std::string, void(*)(machine_state&)> operations {
+  { "+", &binaryOp<std::plus<cell>> },
+  { "-", &binaryOp<std::minus<cell>> },
+  { "*", &binaryOp<std::multiplies<cell>> },
+  { "/", &divisionOp<std::divides<cell>> },
+  { "%", &divisionOp<std::modulus<cell>> },
+  { "&", &binaryOp<std::logical_and<cell>> },
+  { "|", &binaryOp<std::logical_or<cell>> },
+  { "!", &logicalNot },
+  { "=", &binaryOp<std::equal_to<cell>> },
+  { "<>", &binaryOp<std::not_equal_to<cell>> },
+  { "<", &binaryOp<std::less<cell>> },
+  { "<=", &binaryOp<std::less_equal<cell>> },
+  { ">", &binaryOp<std::greater<cell>> },
+  { ">=", &binaryOp<std::greater_equal<cell>> },
+};
+
+template<class... T>
+struct all_integral : std::true_type { };
+
+template<class T, class... Rest>
+struct all_integral<T, Rest...> : std::integral_constant<bool,
+  std::is_integral<T>::value && all_integral<Rest...>::value> { };
+
+/*
+ * Adapts a C++ function on integers into an intrinsic. The arguments are
+ * popped so that the last one comes from the top of the stack, and the
+ * result, unless the function returns void, is pushed.
+ */
+template<class F, F f>
+struct native_word;
+
+template<class R, class... Args, R(*f)(Args...)>
+struct native_word<R(*)(Args...), f>
+{
+  static_assert(all_integral<Args...>::value,
+    "native word arguments must be integers");
+  static_assert(std::is_void<R>::value || std::is_integral<R>::value,
+    "native words must return an integer or void");
+
+  static void call(machine_state& m)
+  {
+    cell args[sizeof...(Args) + 1];
+    for (auto i = sizeof...(Args); i-- > 0; ) {
+      args[i] = m.pop();
+    }
+    invoke(m, args, std::index_sequence_for<Args...> { }, std::is_void<R> { });
+    m.next();
+  }
+
+private:
+  template<size_t... I>
+  static void invoke(
+    machine_state& m, const cell *args, std::index_sequence<I...>,
+    std::false_type)
+  {
+    m.push((cell)f((Args)args[I]...));
+  }
+
+  template<size_t... I>
+  static void invoke(
+    machine_state& m, const cell *args, std::index_sequence<I...>,
+    std::true_type)
+  {
+    f((Args)args[I]...);
+  }
+};
+
+/*
+ * Adds fn, a function of type F, as an intrinsic. Use REGISTER_WORD to have
+ * F deduced.
+ */
+template<class F, F fn>
+void register_word(const std::string& name)
+{
+  intrinsics[toLower(name)] = &native_word<F, fn>::call;
+}
+
+#define REGISTER_WORD(name, fn) register_word<decltype(&fn), &fn>(name)
+
+cell minWord(cell a, cell b) { return std::min(a, b); }
+cell maxWord(cell a, cell b) { return std::max(a, b); }
+cell absWord(cell n) { return n < 0 ? -n : n; }
+cell negateWord(cell n) { return -n; }
+
+void registerNativeWords()
+{
+  REGISTER_WORD("min", minWord);
+  REGISTER_WORD("max", maxWord);
+  REGISTER_WORD("abs", absWord);
+  REGISTER_WORD("negate", negateWord);
+}
+
+/* ==== extensions ==== */
+
+constexpr size_t max_extension_words = 256;
+iforth_word_fn extension_words[max_extension_words];
+size_t num_extension_words = 0;
+
+/*
+ * Extension words are added as intrinsics that call the Nth extension
+ * function, so they are dispatched like any other intrinsic. Errors under
+ * 'catch' can't unwind through the extension, which may have been built
+ * without unwind tables, so the api holds them and they are raised here
+ * once the extension has returned.
+ */
+template<size_t N>
+void extensionWord(machine_state& m)
+{
+  extension_words[N]((iforth_vm*)&m);
+  if (m.extension_error) {
+    auto e = *m.extension_error;
+    m.extension_error.reset();
+    throw e;
+  }
+  m.next();
+}
+
+template<size_t... N>
+constexpr std::array<void(*)(machine_state&), sizeof...(N)>
+extensionTrampolines(std::index_sequence<N...>)
+{
+  return {{ &extensionWord<N>... }};
+}
+
+const auto extension_trampolines =
+  extensionTrampolines(std::make_index_sequence<max_extension_words> { });
+
+machine_state& machineOf(iforth_vm *vm)
+{
+  return *(machine_state*)vm;
+}
+
+/*
+ * Runs f for an api call, returning its result, or failed if an error was
+ * raised by this or an earlier call of the same extension word.
+ */
+template<class R, class F>
+R apiCall(iforth_vm *vm, R failed, F f)
+{
+  auto& m = machineOf(vm);
+  if (m.extension_error) {
+    return failed;
+  }
+  try {
+    return f(m);
+  } catch (const forth_exception& e) {
+    m.extension_error.reset(new forth_exception { e });
+    return failed;
+  }
+}
+
+const iforth_api extension_api {
+  IFORTH_ABI_VERSION,
+  [](iforth_vm *vm) {
+    return apiCall(vm, (iforth_cell)0, [](machine_state& m) {
+      return m.pop();
+    });
+  },
+  [](iforth_vm *vm, iforth_cell v) {
+    apiCall(vm, 0, [v](machine_state& m) {
+      m.push(v);
+      return 0;
+    });
+  },
+  [](iforth_vm *vm, iforth_cell addr, iforth_cell len, int write) {
+    return apiCall(vm, (char*)nullptr, [=](machine_state& m) {
+      return m.mem(addr, len, write != 0);
+    });
+  },
+  [](iforth_vm *vm, const char *message) {
+    apiCall(vm, 0, [message](machine_state& m) {
+      m.error() << message;
+      return 0;
+    });
+  },
+  [](iforth_vm *vm, const char *name, iforth_word_fn fn) {
+    if (num_extension_words == max_extension_words) {
+      return -1;
+    }
+    extension_words[num_extension_words] = fn;
+    intrinsics[toLower(name)] = extension_trampolines[num_extension_words++];
+    return 0;
+  },
+};
+
+/*
+ * Loads a shared object and lets it add its words. Extensions stay loaded
+ * until the program ends.
+ */
+void loadExtensionFile(machine_state& m, const std::string& path)
+{
+  auto handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (!handle) {
+    m.error() << "couldn't load extension " << path << ": " << dlerror();
+  }
+  auto abi = (const uint32_t*)dlsym(handle, "iforth_extension_abi");
+  auto init = (decltype(&iforth_extension_init))
+    dlsym(handle, "iforth_extension_init");
+  if (!abi || !init) {
+    m.error() << path << " is not an extension";
+  } else if (*abi != IFORTH_ABI_VERSION) {
+    m.error() << "extension " << path << " was built for ABI version "
+              << *abi << " instead of " << IFORTH_ABI_VERSION;
+  } else if (init((iforth_vm*)&m, &extension_api) != 0) {
+    m.error() << "couldn't initialize extension " << path;
+  }
+  m.extension_paths.push_back(path);
+}
+
+/*
+ * load-extension <file>
+ */
+void loadExtension(machine_state& m)
+{
+  m.next();
+  m.assert(!m.atEnd() && m.curr_token->kind == tokens::identifier)
+    << "expecting the file name of an extension";
+  loadExtensionFile(m, m.curr_token->to_string());
+  m.next();
+}
+
+bool machine_state::intrinsic(const std::string& id)
+{
+  auto it = intrinsics.find(toLower(id));
+  if (it != intrinsics.end()) {
+    it->second(*this);
+    return true;
+  }
+  return false;
+}
+
+cell machine_state::xt(const std::string& id)
+{
+  auto word = find_word(id);
+  if (word >= 0) {
+    return word;
+  }
+  auto name = toLower(id);
+  auto known = intrinsic_xt_ids.find(name);
+  if (known != intrinsic_xt_ids.end()) {
+    return known->second;
+  }
+  auto it = intrinsics.find(name);
+  auto op = operations.find(name);
+  if (it != intrinsics.end()) {
+    intrinsic_xts.push_back(it->second);
+  } else if (op != operations.end()) {
+    intrinsic_xts.push_back(op->second);
+  } else {
+    error(throw_undefined_word) << "no word named " << id << " in dictionary.";
+  }
+  return intrinsic_xt_ids[name] = -(cell)intrinsic_xts.size();
+}
+
+/*
+ * Calls the word, like an identifier token naming it would.
+ */
+void machine_state::execute(cell xt)
+{
+  if (xt < 0) {
+    assert(-xt <= (cell)intrinsic_xts.size()) << "invalid xt " << xt;
+    intrinsic_xts[-xt - 1](*this);
+    return;
+  }
+  assert(xt < end_addr()) << "invalid xt " << xt;
+  next();
+  rpush();
+  abranch(xt);
+}
+
+/*
+ * Runs the word to completion and returns to the current instruction.
+ */
+void machine_state::execute_nested(cell xt)
+{
+  auto here = curr_token;
+  if (xt < 0) {
+    execute(xt);
+  } else {
+    assert(xt < end_addr()) << "invalid xt " << xt;
+    // The word returns to the end of the program, which stops the loop.
+    auto depth = rstack.size();
+    rpush(end_addr());
+    abranch(xt);
+    while (!atEnd()) {
+      curr_token->interpret(*this, *curr_token);
+    }
+    assert(rstack.size() == depth) << "word left the return stack unbalanced";
+  }
+  curr_token = here;
+}
+
+void interpIdentifier(machine_state& m, const token& tok);
+
+/*
+ * Interprets the current token and, if it calls a word, the rest of the
+ * word, stopping once the word returns.
+ */
+void machine_state::run_token()
+{
+  auto depth = rstack.size();
+  do {
+    curr_token->interpret(*this, *curr_token);
+  } while (!atEnd() && rstack.size() > depth);
+}
+
+bool machine_state::is_immediate(const token& tok) const
+{
+  return isTokenWithId("literal", tok) ||
+         (tok.kind == tokens::identifier && immediates.count(tok.to_string()));
+}
+
+/*
+ * Compiles the body of the definition of name at the current token, up to
+ * the ';'. Immediate words run now, and are replaced by the code they
+ * generate with literal and postpone. The tokens between '[' and ']' run
+ * now, too, and are skipped when the word runs.
+ *
+ * Other identifiers are resolved now, through the search order in effect,
+ * so calls don't look names up. Those left to be looked up as they run are
+ * names of tables and names not yet defined, except for the word itself.
+ */
+void machine_state::compile_definition(const std::string& name)
+{
+  auto outer_compiling = compiling;
+  auto outer_site = site;
+  auto start = ip();
+  compiling = true;
+  while (!atEnd() && curr_token->kind != tokens::end_definition) {
+    auto& tok = *curr_token;
+    if (!compiling) {
+      if (isTokenWithId("]", tok)) {
+        compiling = true;
+        next();
+      } else {
+        run_token();
+      }
+    } else if (isTokenWithId("[", tok)) {
+      compiling = false;
+      next();
+    } else if (parsesOperand(tok)) {
+      next();
+      if (!atEnd()) next();
+    } else if (is_immediate(tok)) {
+      site = ip();
+      generated[site].clear();
+      run_token();
+      patch_site(site);
+    } else {
+      auto& tok = *curr_token;
+      auto plain = tok.interpret.target<void(*)(machine_state&, const token&)>();
+      if (tok.kind == tokens::identifier && plain && *plain == &interpIdentifier) {
+        auto id = tok.to_string();
+        auto word = id == name ? start : find_word(id);
+        if (word >= 0) {
+          bind(ip(), word);
+        } else if (!tables.count(id) && intrinsics.count(toLower(id))) {
+          bind(ip(), xt(id));
+        }
+      }
+      next();
+    }
+  }
+  assert(compiling) << "'[' without ']'";
+  compiling = outer_compiling;
+  site = outer_site;
+}
+
+/*
+ * Makes the token at site run the code generated for it.
+ */
+void machine_state::patch_site(int site)
+{
+  auto& ops = generated[site];
+  auto& tok = token_stream[site];
+  if (ops.size() == 1 && !ops[0].run_token) {
+    auto n = ops[0].value;
+    tok.interpret = [n](machine_state& m, const token& tok) {
+      m.push(n);
+      m.next();
+    };
+    return;
+  }
+  tok.interpret = [ops](machine_state& m, const token& tok) {
+    auto here = m.curr_token;
+    for (auto& op : ops) {
+      if (op.run_token) {
+        m.abranch(op.value);
+        m.run_token();
+      } else {
+        m.push(op.value);
+      }
+    }
+    m.curr_token = here;
+    m.next();
+  };
+}
+
+/*
+ * Makes the identifier at addr call the word with the given xt directly.
+ */
+void machine_state::bind(int addr, cell target)
+{
+  bound[addr] = target;
+  auto& tok = token_stream[addr];
+  if (target >= 0) {
+    tok.interpret = [target](machine_state& m, const token& tok) {
+      m.next();
+      m.rpush();
+      m.abranch(target);
+    };
+  } else {
+    tok.interpret = [fn = intrinsic_xts[-target - 1]](
+      machine_state& m, const token& tok) {
+      fn(m);
+    };
+  }
+}
+
+void noop(machine_state& m, const token& tok)
+{
+  m.next();
+}
+
+/*
+ * Lexes an operator, which must be followed by whitespace.
+ */
+token_opt lexOperation(const char *begin, const char *end)
+{
+  auto p = begin;
+  while (p != end && p - begin <= 2 && !std::isspace(*p)) {
+    ++p;
+  }
+  auto op = operations.find(std::string { begin, p });
+  if (op == operations.end() || (p != end && !std::isspace(*p))) {
+    return { };
+  }
+  auto fn = op->second;
+  return token {
+    tokens::operation, begin, p,
+    [fn](machine_state& m, const token& tok) { fn(m); }
+  };
+}
+
+void interpString(machine_state& m, const char *start, const char *end)
+{
+  m.push(0);
+  for (auto it = end - 2; it != start; --it)
+  {
+    if (*it == '\\') {
+      cell c;
+      if (m.pop(c)) {
+        switch(c) {
+        case 'n': m.push('\n'); break;
+        case 'r': m.push('\r'); break;
+        case '"': m.push('"'); break;
+        case '\\': m.push('\\'); break;
+        case 't': m.push('\t'); break;
+        default: break;
+        }
+      } else {
+        m.push('\\');
+      }
+    } else {
+      m.push((int)*it);
+    }
+  }
+}
+
+/*
+ * Lexes a data table, "table: name n1 n2 ... ;table", parsing the numbers
+ * into a cell array as it goes. Running the token defines name as a word
+ * that pushes the address of the array, which is mapped read-only, and
+ * its length in cells.
+ */
+token_opt lexTable(const char *begin, const char *end)
+{
+  static const char open[] = "table:", close[] = ";table";
+  auto isWs = [=](const char *p) { return p == end || std::isspace(*p); };
+  auto atWord = [=](const char *p, const char *w, size_t n) {
+    return (size_t)(end - p) >= n && !memcmp(p, w, n) && isWs(p + n);
+  };
+  if (!atWord(begin, open, sizeof(open) - 1)) {
+    return { };
+  }
+
+  auto p = begin + sizeof(open) - 1;
+  while (p != end && std::isspace(*p)) ++p;
+  auto name_start = p;
+  while (!isWs(p)) ++p;
+  std::string name { name_start, p };
+
+  auto cells = std::make_shared<std::vector<cell>>();
+  for (;;) {
+    while (p != end && std::isspace(*p)) ++p;
+    auto word = p;
+    while (!isWs(p)) ++p;
+    if (word == p || name.empty()) {
+      std::cerr << "expecting ';table' to end table " << name << std::endl;
+      exit(1);
+    }
+    if (atWord(word, close, sizeof(close) - 1)) {
+      break;
+    }
+    char *num_end = nullptr;
+    errno = 0;
+    auto n = strtoll(word, &num_end, 0);
+    if (num_end != p || errno || !(*word == '-' || std::isdigit(*word))) {
+      std::cerr << "invalid number " << std::string { word, p }
+                << " in table " << name << std::endl;
+      exit(1);
+    }
+    cells->push_back(n);
+  }
+
+  return token {
+    tokens::table, begin, p,
+    [name, cells](machine_state& m, const token& tok)
+    {
+      m.define_table(name, tok.start, *cells);
+      m.next();
+    }
+  };
+}
+
+/*
+ * Looks up an identifier as it runs. Identifiers in compiled words are
+ * usually resolved once instead, by compile_definition.
+ */
+void interpIdentifier(machine_state& m, const token& tok)
+{
+  auto name = tok.to_string();
+  auto word = m.find_word(name);
+  if (word < 0) {
+    auto t = m.tables.empty() ? m.tables.end() : m.tables.find(name);
+    if (t != m.tables.end()) {
+      m.push(t->second.first);
+      m.push(t->second.second);
+      m.next();
+      return;
+    }
+    if (m.intrinsic(name)) {
+      return;
+    }
+    m.error(throw_undefined_word)
+      << "no word named " << name << " in dictionary.";
+  }
+
+  m.next();
+  m.rpush();
+  m.abranch(word);
+}
+
+lex_fn token_table[] {
+  lexRegex(
+    tokens::comment,
+    R"(\([^\)]*\))"
+  ),
+  &lexTable,
+  lexChar(
+    tokens::start_definition,
+    ':',
+    [](machine_state& m, const token& tok)
+    {
+      m.next();
+      if (m.atEnd() || m.curr_token->kind != tokens::identifier) {
+        m.error() << "expecting identifier";
+      }
+      std::string id { m.curr_token->start, m.curr_token->end };
+      auto name = m.ip();
+      m.next();
+      auto start = m.curr_token;
+
+      if (m.compiled_defs.insert(name).second) {
+        m.compile_definition(id);
+      }
+      while (!m.atEnd() && m.curr_token->kind != tokens::end_definition) {
+        m.next();
+      }
+
+      if (m.curr_token->kind != tokens::end_definition) {
+        m.error() << "expecting ':'";
+      }
+
+      m.next();
+      m.define_word(id, m.addr(start));
+      m.tables.erase(id);
+      m.immediates.erase(id);
+      m.last_defined = id;
+    }
+  ),
+  lexChar(
+    tokens::end_definition,
+    ';',
+    [](machine_state& m, const token& tok)
+    {
+      m.exit();
+    }
+  ),
+  lexRegex(
+    tokens::label,
+    R"(\[(?!char\])[^\s]+\])",
+    [](machine_state& m, const token& tok)
+    {
+      m.next();
+      m.labels[std::string { tok.start + 1, tok.end - 1 }] = m.curr_token;
+    }
+  ),
+  lexRegex(
+    tokens::print,
+    R"(\.([cds]|"[^"]*")?)",
+    [](machine_state& m, const token& tok)
+    {
+      if ((tok.end - tok.start) > 1) {
+        if (*(tok.start + 1) == '"') {
+          interpString(m, tok.start + 1, tok.end);
+        } else if (*(tok.start + 1) == 'd') {
+          std::stringstream ss;
+          m.debug(ss);
+          output.write(ss.str());
+          m.next();
+          return;
+        } else if (*(tok.start + 1) == 'c') {
+          output.put((char)m.pop());
+          m.next();
+          return;
+        }
+        while (true) {
+          cell c;
+          if (m.pop(c)) {
+            if (c == 0) {
+              break;
+            } else {
+              output.put((char)c);
+            }
+          } else {
+            m.error() << "no null terminator found before end of stack reached";
+          }
+        }
+      } else {
+        output.number(m.pop(), m.base());
+        output.put('\n');
+      }
+      m.next();
+    }
+  ),
+  lexRegex(
+    tokens::number,
+    R"((-)?(0[xX][0-9a-fA-F]+|0[0-7]*|[1-9][0-9]*))",
+    [](machine_state& m, const token& tok)
+    {
+      m.push(strtol(tok.start, nullptr, 0));
+      m.next();
+    }
+  ),
+  lexRegex(
+    tokens::counted_string,
+    R"(s"[^"]*")",
+    [](machine_state& m, const token& tok)
+    {
+      m.push(m.text_addr(tok.start + 2));
+      m.push(tok.end - tok.start - 3);
+      m.next();
+    }
+  ),
+  lexRegex(
+    tokens::string,
+    R"("[^"]*")",
+    [](machine_state& m, const token& tok)
+    {
+      interpString(m, tok.start, tok.end);
       m.next();
     }
-  },
+  ),
+  &lexOperation,
+  lexRegex(
+    tokens::identifier,
+    R"([^\s]+)",
+    &interpIdentifier
+  ),
+};
+static_assert(sizeof(token_table) / sizeof(lex_fn) == num_token_kinds);
+
+const char *skipWs(const char *c, const char *end)
+{
+  while (c && c != end && std::isspace(*c)) { ++c; }
+  return c;
+}
+
+token_opt lexToken(const char *input, const char *end)
+{
+  for (auto& fn : token_table)
+  {
+    token_opt t;
+    if ((t = fn(input, end))) {
+      return t;
+    }
+  }
+  return { };
+}
+
+/*
+ * Lexes a program into a token stream allocated from a.
+ */
+token_vector lexTokens(const char *input, const char *end, arena& a)
+{
+  std::vector<token> tokens;
+  for (const char *it = skipWs(input, end); it != end; it = skipWs(it, end))
+  {
+    auto t = lexToken(it, end);
+    if (!t) {
+      const char *tokEnd = it;
+      while (tokEnd != end && !std::isspace(*tokEnd)) ++tokEnd;
+      std::cerr << "error at position " << (std::ptrdiff_t)(it - input)
+                << ": unrecognized token " << std::string { it, tokEnd }
+                << std::endl;
+      exit(1);
+    }
+    tokens.push_back(*t);
+    it = t->end;
+  }
+  // Copied once the size is known, as growing the stream in the arena would
+  // leave each smaller copy behind.
+  return token_vector {
+    std::make_move_iterator(tokens.begin()),
+    std::make_move_iterator(tokens.end()),
+    arena_allocator<token> { a }
+  };
+}
+
+/* ==== optimizer ==== */
+
+/*
+ * A word defined in the program text. Only words with a single definition
+ * are considered by the optimizer since otherwise the definition in effect
+ * at a call site depends on the order of execution.
+ */
+struct word_def
+{
+  size_t start; // first token of the body
+  size_t end;   // the terminating ';'
+  bool pure;
+  size_t ready; // call sites before this token may precede a definition
+};
+
+bool isPureIntrinsic(const std::string& id)
+{
+  static const std::set<std::string> pure {
+    "dup", "swap", "over", "rot", "drop", "if", "else", "then",
+    "branch", "?branch", ">r", "r>", "r@", "rdrop", "exit",
+    "do", "loop", "i", "j", "cells", "hash-cell",
+  };
+  return pure.count(toLower(id)) != 0;
+}
+
+/*
+ * True if the token at idx is consumed as an operand by the token before it
+ * (a branch target, the name of a definition or of a ticked or postponed
+ * word, an extension's file name or a character) rather than interpreted.
+ */
+bool isParsedOperand(const token_vector& tokens, size_t idx)
+{
+  if (idx == 0) {
+    return false;
+  }
+  auto& prev = tokens[idx - 1];
+  return prev.kind == tokens::start_definition || parsesOperand(prev);
+}
+
+std::map<std::string, word_def> findWordDefs(const token_vector& tokens)
+{
+  std::map<std::string, word_def> defs;
+  std::set<std::string> redefined;
+  // Every name the program defines, lower-cased. A call to one of these
+  // that isn't in defs may not reach the intrinsic of the same name.
+  std::set<std::string> defined;
+
+  // Which definition a name refers to also depends on the search order
+  // once the program changes it or the current wordlist.
+  for (auto& tok : tokens) {
+    for (auto id : { "set-order", "set-current", "definitions", "also",
+                     "only", "previous" }) {
+      if (isTokenWithId(id, tok)) {
+        return defs;
+      }
+    }
+  }
+
+  for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+    if (tokens[i].kind != tokens::start_definition ||
+        tokens[i + 1].kind != tokens::identifier) {
+      continue;
+    }
+    auto id = tokens[i + 1].to_string();
+    auto end = i + 2;
+    while (end < tokens.size() && tokens[end].kind != tokens::end_definition) {
+      ++end;
+    }
+    if (end == tokens.size()) {
+      break;
+    }
+    if (defs.count(id) || intrinsics.count(toLower(id))) {
+      redefined.insert(id);
+    }
+    defined.insert(toLower(id));
+    // Immediate words run while other words are compiled, not where they
+    // are called.
+    auto immediate = end + 1 < tokens.size() &&
+                     isTokenWithId("immediate", tokens[end + 1]);
+    defs[id] = word_def { i + 2, end, !immediate, end };
+  }
+  for (auto& id : redefined) {
+    defs.erase(id);
+  }
+
+  // A word is pure if its body only touches the stacks and calls other pure
+  // words. Start optimistic so recursive words qualify and iterate until no
+  // more words are disqualified.
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (auto& d : defs) {
+      auto& def = d.second;
+      for (auto i = def.start; i < def.end; ++i) {
+        auto& tok = tokens[i];
+        if (isParsedOperand(tokens, i) || tok.kind != tokens::identifier) {
+          if (tok.kind == tokens::print ||
+              tok.kind == tokens::start_definition ||
+              tok.kind == tokens::table) {
+            changed |= def.pure;
+            def.pure = false;
+          }
+          continue;
+        }
+        auto callee = defs.find(tok.to_string());
+        if (callee == defs.end()) {
+          if (defined.count(toLower(tok.to_string())) ||
+              !isPureIntrinsic(tok.to_string())) {
+            changed |= def.pure;
+            def.pure = false;
+          }
+          continue;
+        }
+        if (!callee->second.pure) {
+          changed |= def.pure;
+          def.pure = false;
+        }
+        if (callee->second.ready > def.ready) {
+          def.ready = callee->second.ready;
+          changed = true;
+        }
+      }
+    }
+  }
+  return defs;
+}
+
+/*
+ * Checks that the next token may run at compile time: it must not have side
+ * effects outside of the stacks, touch the return address of the call being
+ * evaluated or trap.
+ */
+bool isSpeculationSafe(const machine_state& m)
+{
+  auto& tok = *m.curr_token;
+  switch (tok.kind) {
+  case tokens::print:
+  case tokens::start_definition:
+  case tokens::table:
+    return false;
+  case tokens::identifier:
+    break;
+  default:
+    return true;
+  }
+
+  auto id = tok.to_string();
+  if (m.find_word(id) >= 0) {
+    return true;
+  }
+  if (isTokenWithId("r>", tok) || isTokenWithId("r@", tok) ||
+      isTokenWithId("rdrop", tok)) {
+    return m.rstack.size() > 1;
+  }
+  if (isTokenWithId("i", tok) || isTokenWithId("loop", tok)) {
+    return m.rstack.size() > 3;
+  }
+  if (isTokenWithId("j", tok)) {
+    return m.rstack.size() > 6;
+  }
+  return isPureIntrinsic(id);
+}
+
+/*
+ * Runs the word whose body starts at entry on the given stack, as if it had
+ * been called from the end of the program. Returns false if the word did
+ * something that can't be done at compile time or ran out of fuel.
+ */
+bool speculate(
+  machine_state& m, size_t entry, std::deque<cell>& stack, size_t fuel)
+{
+  m.dstack = stack;
+  m.rstack.clear();
+  m.rpush(m.end_addr());
+  m.abranch(entry);
+  try {
+    while (!m.atEnd()) {
+      if (fuel-- == 0 || !isSpeculationSafe(m)) {
+        return false;
+      }
+      m.curr_token->interpret(m, *m.curr_token);
+    }
+  } catch (const speculation_failed&) {
+    return false;
+  }
+  if (!m.rstack.empty()) {
+    return false;
+  }
+  stack = std::move(m.dstack);
+  return true;
+}
+
+/*
+ * Replaces calls to pure words whose arguments are all number literals with
+ * the values they compute. The first token of each folded call site pushes
+ * the results and skips the rest of the site; the remaining tokens are left
+ * in place so addresses, branch offsets and .d output are unchanged.
+ * Returns the number of call sites folded.
+ */
+size_t foldPureCalls(token_vector& tokens, size_t fuel)
+{
+  constexpr size_t max_args = 8;
+
+  auto defs = findWordDefs(tokens);
+  machine_state sandbox { tokens };
+  sandbox.speculative = true;
+  for (auto& d : defs) {
+    sandbox.define_word(d.first, d.second.start);
+  }
+
+  size_t folded = 0;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    if (tokens[i].kind != tokens::identifier || isParsedOperand(tokens, i)) {
+      continue;
+    }
+    auto def = defs.find(tokens[i].to_string());
+    if (def == defs.end() || !def->second.pure || i <= def->second.ready) {
+      continue;
+    }
+
+    size_t nlits = 0;
+    while (nlits < std::min(i, max_args) &&
+           tokens[i - nlits - 1].kind == tokens::number) {
+      ++nlits;
+    }
+    if (nlits && isParsedOperand(tokens, i - nlits)) {
+      --nlits;
+    }
+
+    // The word consumes as many of the literals as the fewest it can run
+    // with; anything deeper in the stack is never observed.
+    for (size_t nargs = 0; nargs <= nlits; ++nargs) {
+      std::deque<cell> stack;
+      for (auto j = i - nargs; j < i; ++j) {
+        stack.push_back(strtol(tokens[j].start, nullptr, 0));
+      }
+      if (!speculate(sandbox, def->second.start, stack, fuel)) {
+        continue;
+      }
+      std::vector<cell> values { stack.begin(), stack.end() };
+      int skip = nargs + 1;
+      tokens[i - nargs].interpret =
+        [values, skip](machine_state& m, const token&)
+        {
+          for (auto v : values) {
+            m.push(v);
+          }
+          m.rbranch(skip);
+        };
+      ++folded;
+      break;
+    }
+  }
+  return folded;
+}
+
+/*
+ * Symbolic value c + a * i + s used to analyze loop bodies, where i is the
+ * loop index and s, if sym >= 0, is the value that was sym cells below the
+ * loop parameters on the data stack when the loop started.
+ */
+struct linear
+{
+  cell c;
+  cell a;
+  int sym;
+
+  bool invariant() const
   {
-    "exit",
-    [](machine_state& m) {
-      m.exit();
+    return a == 0;
+  }
+
+  bool operator==(const linear& o) const
+  {
+    return c == o.c && a == o.a && sym == o.sym;
+  }
+
+  cell eval(const std::deque<cell>& stack, cell i) const
+  {
+    return c + a * i + (sym >= 0 ? stack[stack.size() - 3 - sym] : 0);
+  }
+};
+
+/*
+ * Symbolic value on the data stack while analyzing a loop body: a linear
+ * value, the cell at a linear address, or that cell combined with a loop
+ * invariant operand.
+ */
+struct loop_value
+{
+  enum kinds { lin, load, update } kind;
+  linear val;
+  char op;
+  linear operand;
+};
+
+/*
+ * A counted loop that can be run by a native kernel instead of being
+ * interpreted. A map loop replaces each cell it visits with op applied to
+ * the cell and the operand ('r' is reversed subtraction, '=' a plain
+ * store); a reduce loop adds the cells it visits to the accumulator on the
+ * data stack.
+ */
+struct loop_kernel
+{
+  enum kinds { map, reduce } kind;
+  linear addr;
+  char op;
+  linear operand;
+  int acc;
+  int depth;
+  int skip;
+};
+
+bool combine(loop_value& l, const loop_value& r, char op)
+{
+  if (l.kind == loop_value::lin && r.kind == loop_value::lin) {
+    auto& a = l.val;
+    auto& b = r.val;
+    bool a_const = !a.a && a.sym < 0, b_const = !b.a && b.sym < 0;
+    switch (op) {
+    case '+':
+      if (a.sym >= 0 && b.sym >= 0) return false;
+      a = linear { a.c + b.c, a.a + b.a, std::max(a.sym, b.sym) };
+      return true;
+    case '-':
+      if (b.sym >= 0) return false;
+      a = linear { a.c - b.c, a.a - b.a, a.sym };
+      return true;
+    case '*':
+      if (a_const && b.sym < 0) {
+        a = linear { b.c * a.c, b.a * a.c, -1 };
+      } else if (b_const && a.sym < 0) {
+        a = linear { a.c * b.c, a.a * b.c, -1 };
+      } else {
+        return false;
+      }
+      return true;
     }
-  },
+    return false;
+  }
+
+  auto load_left = l.kind == loop_value::load;
+  auto& load = load_left ? l : r;
+  auto& other = load_left ? r : l;
+  if (load.kind != loop_value::load || other.kind != loop_value::lin ||
+      !other.val.invariant()) {
+    return false;
+  }
+  if (op == '-' && !load_left) {
+    op = 'r';
+  } else if (op != '+' && op != '-' && op != '*') {
+    return false;
+  }
+  l = loop_value { loop_value::update, load.val, op, other.val };
+  return true;
+}
+
+/*
+ * Tries to turn the do ... loop starting at the given token into a kernel.
+ * The body may only compute with the loop index, constants and loop
+ * invariant stack values, load and store at most one cell per iteration at
+ * an address that advances by one cell per iteration, and must leave the
+ * stack as it found it apart from an accumulator.
+ */
+bool analyzeLoop(
+  const token_vector& tokens, size_t do_idx,
+  const std::set<std::string>& defined, loop_kernel& k)
+{
+  constexpr int nsyms = 4;
+  std::vector<loop_value> stack;
+  for (int j = nsyms - 1; j >= 0; --j) {
+    stack.push_back(loop_value { loop_value::lin, linear { 0, 0, j } });
+  }
+  auto pop = [&stack](loop_value& v) {
+    if (stack.empty()) return false;
+    v = stack.back();
+    stack.pop_back();
+    return true;
+  };
+
+  bool loaded = false, stored = false;
+  linear load_addr { }, store_addr { };
+  loop_value stored_value { };
+  size_t idx = do_idx + 1;
+  for (; idx < tokens.size(); ++idx) {
+    auto& tok = tokens[idx];
+    if (tok.kind == tokens::comment) {
+      continue;
+    }
+    if (tok.kind == tokens::number) {
+      cell n = strtol(tok.start, nullptr, 0);
+      stack.push_back(loop_value { loop_value::lin, linear { n, 0, -1 } });
+      continue;
+    }
+    loop_value a, b, c;
+    if (tok.kind == tokens::operation) {
+      if (tok.end - tok.start != 1 || !pop(b) || !pop(a) ||
+          !combine(a, b, *tok.start)) {
+        return false;
+      }
+      stack.push_back(a);
+      continue;
+    }
+    if (tok.kind != tokens::identifier || defined.count(tok.to_string())) {
+      return false;
+    }
+
+    auto id = toLower(tok.to_string());
+    if (id == "loop") {
+      break;
+    } else if (id == "i") {
+      stack.push_back(loop_value { loop_value::lin, linear { 0, 1, -1 } });
+    } else if (id == "dup") {
+      if (!pop(a)) return false;
+      stack.insert(stack.end(), { a, a });
+    } else if (id == "drop") {
+      if (!pop(a)) return false;
+    } else if (id == "swap") {
+      if (!pop(b) || !pop(a)) return false;
+      stack.insert(stack.end(), { b, a });
+    } else if (id == "over") {
+      if (!pop(b) || !pop(a)) return false;
+      stack.insert(stack.end(), { a, b, a });
+    } else if (id == "rot") {
+      if (!pop(c) || !pop(b) || !pop(a)) return false;
+      stack.insert(stack.end(), { b, c, a });
+    } else if (id == "cells") {
+      b = loop_value { loop_value::lin, linear { sizeof(cell), 0, -1 } };
+      if (!pop(a) || !combine(a, b, '*')) return false;
+      stack.push_back(a);
+    } else if (id == "@") {
+      if (!pop(a) || a.kind != loop_value::lin) return false;
+      if (loaded && !(load_addr == a.val)) return false;
+      loaded = true;
+      load_addr = a.val;
+      stack.push_back(loop_value { loop_value::load, a.val });
+    } else if (id == "store") {
+      if (stored || !pop(a) || !pop(b) || a.kind != loop_value::lin) {
+        return false;
+      }
+      stored = true;
+      store_addr = a.val;
+      stored_value = b;
+    } else {
+      return false;
+    }
+  }
+  if (idx == tokens.size() || stack.size() != nsyms) {
+    return false;
+  }
+
+  k.acc = -1;
+  for (int j = 0; j < nsyms; ++j) {
+    auto& v = stack[nsyms - 1 - j];
+    if (v.kind == loop_value::lin && v.val == linear { 0, 0, j }) {
+      continue;
+    }
+    if (k.acc >= 0 || v.kind != loop_value::update || v.op != '+' ||
+        !(v.operand == linear { 0, 0, j })) {
+      return false;
+    }
+    k.acc = j;
+  }
+
+  if (stored && k.acc < 0) {
+    k.kind = loop_kernel::map;
+    k.addr = store_addr;
+    if (stored_value.kind == loop_value::update &&
+        stored_value.val == store_addr) {
+      k.op = stored_value.op;
+      k.operand = stored_value.operand;
+    } else if (!loaded && stored_value.kind == loop_value::lin &&
+               stored_value.val.invariant()) {
+      k.op = '=';
+      k.operand = stored_value.val;
+    } else {
+      return false;
+    }
+  } else if (!stored && k.acc >= 0) {
+    k.kind = loop_kernel::reduce;
+    k.addr = load_addr;
+    k.operand = linear { 0, 0, -1 };
+    if (k.addr.sym == k.acc) {
+      return false;
+    }
+  } else {
+    return false;
+  }
+
+  if (k.addr.a != sizeof(cell)) {
+    return false;
+  }
+  k.depth = std::max({ k.addr.sym, k.operand.sym, k.acc }) + 1;
+  k.skip = idx - do_idx + 1;
+  return true;
+}
+
+interp_fn loopKernel(const loop_kernel& k)
+{
+  return [k](machine_state& m, const token&)
+  {
+    auto& s = m.dstack;
+    if ((int)s.size() < k.depth + 2) {
+      doLoop(m);
+      return;
+    }
+    auto start = s[s.size() - 1];
+    auto n = s[s.size() - 2] - start;
+    auto addr = k.addr.eval(s, start);
+    auto write = k.kind == loop_kernel::map;
+    if (n <= 0 || !m.valid_cells(addr, n, write)) {
+      // Let the interpreter handle loops that run once from wrapping
+      // around and report bad addresses where they happen.
+      doLoop(m);
+      return;
+    }
+    auto p = m.mem_cells(addr, n, write);
+    if (k.kind == loop_kernel::map) {
+      updateCells(p, n, k.op, k.operand.eval(s, start));
+    } else {
+      auto& acc = s[s.size() - 3 - k.acc];
+      acc = (ucell)acc + sumCells(p, n);
+    }
+    m.pop();
+    m.pop();
+    m.rbranch(k.skip);
+  };
+}
+
+/*
+ * Replaces counted loops that analyzeLoop recognizes with native kernels
+ * that process the whole range at once. The loop body is left in place.
+ * Returns the number of loops replaced.
+ */
+size_t vectorizeLoops(token_vector& tokens)
+{
+  std::set<std::string> defined;
+  for (size_t i = 0; i + 1 < tokens.size(); ++i) {
+    if (tokens[i].kind == tokens::start_definition) {
+      defined.insert(tokens[i + 1].to_string());
+    }
+  }
+  if (defined.count("do")) {
+    return 0;
+  }
+
+  size_t vectorized = 0;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    loop_kernel k;
+    if (isTokenWithId("do", tokens[i]) && !isParsedOperand(tokens, i) &&
+        analyzeLoop(tokens, i, defined, k)) {
+      tokens[i].interpret = loopKernel(k);
+      ++vectorized;
+    }
+  }
+  return vectorized;
+}
+
+/*
+ * '[' only means something inside a definition, where the tokens up to ']'
+ * run while it is compiled and are skipped when it runs. Elsewhere it
+ * would silently skip them, so make those '['s errors instead.
+ */
+void checkBrackets(token_vector& tokens)
+{
+  bool defining = false;
+  for (size_t i = 0; i < tokens.size(); ++i) {
+    auto& tok = tokens[i];
+    if (isParsedOperand(tokens, i)) {
+      continue;
+    }
+    if (tok.kind == tokens::start_definition) {
+      defining = true;
+    } else if (tok.kind == tokens::end_definition) {
+      defining = false;
+    } else if (!defining && isTokenWithId("[", tok)) {
+      tok.interpret = [](machine_state& m, const token& tok) {
+        m.error() << "'[' outside of a definition";
+      };
+    }
+  }
+}
+
+/* ==== driver ==== */
+
+struct options
+{
+  int opt_level = 1;
+  size_t fold_fuel = 1000000;
+  bool verbose = false;
+  std::string input;
+  std::string preload;
+  cell checkpoint_ns = 0;
+  std::string checkpoint_file = "forth.checkpoint";
+  std::string restore;
+  int dump_window = 32;
+  int dump_cells = 32;
+  size_t sort_threads = 0;
+  size_t parallel_sort_min = 1 << 20;
+  std::string core_dump;
+  std::string view_core;
+  std::vector<std::string> files;
 };
 
-bool machine_state::intrinsic(const std::string& id)
+void usage(const char *argv0)
 {
-  auto it = intrinsics.find(toLower(id));
-  if (it != intrinsics.end()) {
-    it->second(*this);
+  std::cerr << "usage: " << argv0 << " [options] [file | -]...\n"
+            << "  -O<n>              optimization level (default 1, 0 disables)\n"
+            << "  --fold-fuel=<n>    max instructions spent folding one call\n"
+            << "  --input=<f>        read input words from f instead of stdin\n"
+            << "  --preload=<f>      map f, an array of little-endian 64-bit\n"
+            << "                     cells, into memory (see 'preloaded')\n"
+            << "  --checkpoint-every=<s>\n"
+            << "                     snapshot the machine every s seconds\n"
+            << "  --checkpoint-file=<f>\n"
+            << "                     where to write snapshots\n"
+            << "                     (default forth.checkpoint)\n"
+            << "  --restore=<f>      resume the program saved in snapshot f\n"
+            << "  --sort-threads=<n> split large sorts into n runs\n"
+            << "                     (default one per CPU)\n"
+            << "  --parallel-sort-min=<n>\n"
+            << "                     split sorts of at least n cells\n"
+            << "                     (default 1048576)\n"
+            << "  --dump-window=<n>  machine dumps show the n tokens either\n"
+            << "                     side of ip (default 32)\n"
+            << "  --dump-cells=<n>   machine dumps show the top n cells of\n"
+            << "                     each stack (default 32)\n"
+            << "  --full-dump        machine dumps show everything\n"
+            << "  --core-dump=<f>    on an error, write the machine to f in\n"
+            << "                     snapshot format\n"
+            << "  --view-core=<f>    print the full dump of core file f\n"
+            << "  -v                 report statistics and timings on stderr\n";
+  exit(1);
+}
+
+bool parseOption(const std::string& arg, const char *name, std::string& value)
+{
+  std::string prefix { name };
+  if (arg.compare(0, prefix.size(), prefix) != 0) {
+    return false;
+  }
+  value = arg.substr(prefix.size());
+  return true;
+}
+
+/*
+ * Parses the value of an option that takes a non-negative count.
+ */
+int parseCount(const char *argv0, const std::string& arg,
+               const std::string& value)
+{
+  char *end;
+  errno = 0;
+  auto n = strtol(value.c_str(), &end, 0);
+  if (value.empty() || *end || errno || n < 0 ||
+      n > std::numeric_limits<int>::max()) {
+    std::cerr << "invalid count in " << arg << std::endl;
+    usage(argv0);
+  }
+  return n;
+}
+
+options parseOptions(int argc, char *const argv[])
+{
+  options opts;
+  for (int n = 1; n < argc; ++n) {
+    std::string arg { argv[n] }, value;
+    if (arg == "-" || arg[0] != '-') {
+      opts.files.push_back(arg);
+    } else if (parseOption(arg, "-O", value)) {
+      opts.opt_level = value.empty() ? 1 : atoi(value.c_str());
+    } else if (parseOption(arg, "--fold-fuel=", value)) {
+      opts.fold_fuel = strtoul(value.c_str(), nullptr, 0);
+    } else if (parseOption(arg, "--preload=", value)) {
+      opts.preload = value;
+    } else if (parseOption(arg, "--input=", value)) {
+      opts.input = value;
+    } else if (parseOption(arg, "--checkpoint-every=", value)) {
+      opts.checkpoint_ns = std::max(strtod(value.c_str(), nullptr), 0.) * 1e9;
+      if (!opts.checkpoint_ns) {
+        opts.checkpoint_ns = 1;
+      }
+    } else if (parseOption(arg, "--checkpoint-file=", value)) {
+      opts.checkpoint_file = value;
+    } else if (parseOption(arg, "--restore=", value)) {
+      opts.restore = value;
+    } else if (parseOption(arg, "--sort-threads=", value)) {
+      opts.sort_threads = strtoul(value.c_str(), nullptr, 0);
+    } else if (parseOption(arg, "--parallel-sort-min=", value)) {
+      opts.parallel_sort_min = strtoul(value.c_str(), nullptr, 0);
+    } else if (parseOption(arg, "--dump-window=", value)) {
+      opts.dump_window = parseCount(argv[0], arg, value);
+    } else if (parseOption(arg, "--dump-cells=", value)) {
+      opts.dump_cells = parseCount(argv[0], arg, value);
+    } else if (arg == "--full-dump") {
+      opts.dump_window = opts.dump_cells = -1;
+    } else if (parseOption(arg, "--core-dump=", value)) {
+      opts.core_dump = value;
+    } else if (parseOption(arg, "--view-core=", value)) {
+      opts.view_core = value;
+    } else if (arg == "-v") {
+      opts.verbose = true;
+    } else {
+      std::cerr << "unknown option " << arg << std::endl;
+      usage(argv[0]);
+    }
+  }
+  return opts;
+}
+
+/*
+ * Snapshots hold everything needed to resume a program: its text and the
+ * options it was compiled with, then the machine state. Values are written
+ * in host byte order; strings and arrays are prefixed by their length.
+ * Open files, block files and mappings made with map-file are not saved;
+ * the input reader and changes to the preloaded file's mapping are.
+ *
+ * Core files use the same format with their own magic. They are written
+ * after the failing instruction has popped its operands, so they can be
+ * viewed but not resumed.
+ */
+static const char snapshot_magic[8] = { 'i','f','s','n','a','p','0','6' };
+static const char core_magic[8] = { 'i','f','c','o','r','e','0','6' };
+
+template<class T>
+void put(std::ostream& out, const T& v)
+{
+  static_assert(std::is_trivially_copyable<T>::value, "not serializable");
+  out.write((const char*)&v, sizeof(v));
+}
+
+void put(std::ostream& out, const std::string& s)
+{
+  put(out, (cell)s.size());
+  out.write(s.data(), s.size());
+}
+
+template<class T>
+bool get(std::istream& in, T& v)
+{
+  static_assert(std::is_trivially_copyable<T>::value, "not serializable");
+  return (bool)in.read((char*)&v, sizeof(v));
+}
+
+bool get(std::istream& in, std::string& s)
+{
+  cell n;
+  if (!get(in, n) || n < 0 || n > (1ll << 40)) {
+    return false;
+  }
+  s.resize(n);
+  return (bool)in.read(&s[0], n);
+}
+
+template<class C>
+void putCells(std::ostream& out, const C& cells)
+{
+  put(out, (cell)cells.size());
+  for (auto c : cells) put(out, (cell)c);
+}
+
+template<class C>
+bool getCells(std::istream& in, C& cells)
+{
+  cell n, c;
+  if (!get(in, n) || n < 0) {
+    return false;
+  }
+  cells.clear();
+  while (n--) {
+    if (!get(in, c)) return false;
+    cells.push_back(c);
+  }
+  return true;
+}
+
+void putAddrs(
+  std::ostream& out, const machine_state& m,
+  const label_map& words)
+{
+  put(out, (cell)words.size());
+  for (auto& w : words) {
+    put(out, w.first);
+    put(out, (cell)m.addr(w.second));
+  }
+}
+
+bool getAddrs(
+  std::istream& in, const machine_state& m,
+  label_map& words)
+{
+  cell n, addr;
+  std::string name;
+  if (!get(in, n)) return false;
+  words.clear();
+  while (n--) {
+    if (!get(in, name) || !get(in, addr) || addr < 0 || addr > m.end_addr()) {
+      return false;
+    }
+    words[name] = m.abs_inst(addr);
+  }
+  return true;
+}
+
+/*
+ * The program's input reader: its buffer, the file offset it has read up
+ * to and the line 'refill' found.
+ */
+void putInput(std::ostream& out, const machine_state& m)
+{
+  put(out, m.source_addr);
+  put(out, m.source_len);
+  auto in = m.input_.get();
+  put(out, (cell)(in != nullptr));
+  if (in) {
+    put(out, m.input_base);
+    put(out, (cell)in->data.size());
+    put(out, (cell)in->start);
+    put(out, (cell)in->end);
+    out.write(in->data.data(), in->end);
+    put(out, (cell)lseek(in->fd, 0, SEEK_CUR));
+  }
+}
+
+/*
+ * Restores the input reader and, when the input is a file, carries on
+ * reading it where the snapshot left off.
+ */
+bool getInput(std::istream& in, machine_state& m)
+{
+  cell present, base, size, start, end, offset;
+  if (!get(in, m.source_addr) || !get(in, m.source_len) ||
+      !get(in, present)) {
+    return false;
+  }
+  if (!present) {
     return true;
   }
-  return false;
-}
-
-void noop(machine_state& m, const token& tok)
-{
-  m.next();
+  if (!get(in, base) || !get(in, size) || !get(in, start) ||
+      !get(in, end) || start < 0 || start > end || end > size ||
+      size > machine_state::max_input_buffer) {
+    return false;
+  }
+  m.input_.reset(
+    new input_buffer { m.input_fd, machine_state::max_input_buffer });
+  auto& buf = *m.input_;
+  buf.data.resize(size);
+  buf.start = start;
+  buf.end = end;
+  if (!in.read(buf.data.data(), end) || !get(in, offset)) {
+    return false;
+  }
+  if (offset >= 0 && lseek(m.input_fd, offset, SEEK_SET) != offset) {
+    return false;
+  }
+  m.input_base = base;
+  m.regions.push_back(memory_region { base, size, buf.data.data(), false });
+  return true;
+}
+
+/*
+ * The pages of the copy-on-write mapping of the preloaded file that the
+ * program changed, found by comparing the mapping with the file.
+ */
+bool putPreload(
+  std::ostream& out, const machine_state& m, const std::string& file)
+{
+  constexpr cell page = 4096;
+  auto r = std::find_if(m.regions.begin(), m.regions.end(),
+    [&](const memory_region& r) { return r.base == m.preload_addr; });
+  std::vector<cell> changed;
+  if (m.preload_addr && r != m.regions.end()) {
+    auto fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      return false;
+    }
+    char buf[page];
+    for (cell off = 0; off < r->size; off += page) {
+      auto n = std::min(page, r->size - off);
+      if (pread(fd, buf, n, off) != n || memcmp(buf, r->data + off, n)) {
+        changed.push_back(off);
+      }
+    }
+    close(fd);
+  }
+  put(out, (cell)changed.size());
+  for (auto off : changed) {
+    auto n = std::min(page, r->size - off);
+    put(out, off);
+    put(out, n);
+    out.write(r->data + off, n);
+  }
+  return true;
 }
 
-bool isOperation(const char *begin, const char *end)
+bool getPreload(std::istream& in, machine_state& m)
 {
-  static std::regex opRegex { R"(([-+*/%&|!=]|<>|<(=)?|>(=)?))" };
-  return std::regex_match(begin, end, opRegex);
+  cell n, off, len;
+  auto r = m.preload_addr ? m.region_at(m.preload_addr) : nullptr;
+  if (!get(in, n)) return false;
+  while (n--) {
+    if (!r || !get(in, off) || !get(in, len) || off < 0 || len < 0 ||
+        off + len > r->size || !in.read(r->data + off, len)) {
+      return false;
+    }
+  }
+  return true;
 }
 
-void interpOperation(machine_state& m, const token& tok)
+bool writeSnapshot(
+  std::ostream& out, const machine_state& m, const std::string& text,
+  const options& opts, bool core = false)
 {
-  if (*tok.start == '!') {
-    m.push(!m.pop());
-  } else {
-    auto r = m.pop();
-    auto l = m.pop();
+  out.write(core ? core_magic : snapshot_magic, sizeof(snapshot_magic));
+  put(out, opts.opt_level);
+  put(out, opts.fold_fuel);
+  put(out, opts.preload);
+  put(out, opts.input);
+  put(out, text);
 
-    switch (*tok.start)
-    {
-    case '+': m.push(l + r); break;
-    case '-': m.push(l - r); break;
-    case '*': m.push(l * r); break;
-    case '/': m.push(l / r); break;
-    case '%': m.push(l % r); break;
-    case '&': m.push(l && r); break;
-    case '|': m.push(l || r); break;
-    case '<': {
-        if (tok.end == tok.start + 1) {
-          m.push(l < r);
-        } else {
-          if (*(tok.start + 1) == '=') {
-            m.push(l <= r);
-          } else if (*(tok.start + 1) == '>') {
-            m.push(l != r);
-          } else {
-            m.error() << "malformed binary operator beginning with '<'";
-          }
-        }
-      }
-      break;
-    case '>': {
-        if (tok.end == tok.start + 1) {
-          m.push(l > r);
-        } else {
-          m.assert(*(tok.start + 1) == '=')
-            << "malformed binary operator beginning with '>'";
-          m.push(l >= r);
-        }
+  put(out, (cell)m.ip());
+  putCells(out, m.dstack);
+  putCells(out, m.rstack);
+  put(out, (cell)m.wordlists.size());
+  for (auto& words : m.wordlists) {
+    put(out, (cell)words.data[0]);
+    for (size_t i = 0; i < words.slots(); ++i) {
+      if (words.ctrl()[i] < hash_table::empty) {
+        put(out, m.symbol_names[words.keys()[i]]);
+        put(out, words.values()[i]);
       }
-      break;
-    case '=': m.push(l == r); break;
     }
   }
-  m.next();
+  putCells(out, m.search_order);
+  put(out, m.current);
+  putAddrs(out, m, m.labels);
+  put(out, (cell)m.tables.size());
+  for (auto& t : m.tables) {
+    put(out, t.first);
+    put(out, t.second.first);
+    put(out, t.second.second);
+  }
+  put(out, (cell)m.table_bases.size());
+  for (auto& t : m.table_bases) {
+    put(out, (cell)(t.first - m.text_begin));
+    put(out, t.second);
+  }
+  put(out, (cell)m.extension_paths.size());
+  for (auto& path : m.extension_paths) {
+    put(out, path);
+  }
+  put(out, (cell)m.intrinsic_xt_ids.size());
+  for (auto& x : m.intrinsic_xt_ids) {
+    put(out, x.first);
+    put(out, x.second);
+  }
+  put(out, (cell)m.hash_tables.size());
+  for (auto& t : m.hash_tables) {
+    put(out, t.first);
+    put(out, (cell)t.second->tombstones);
+    putCells(out, t.second->data);
+  }
+  put(out, (cell)m.bignums.size());
+  for (auto& b : m.bignums) {
+    put(out, (cell)(b ? 1 + b->negative : 0));
+    if (b) {
+      putCells(out, b->mag);
+    }
+  }
+  put(out, m.last_defined);
+  put(out, (cell)m.immediates.size());
+  for (auto& name : m.immediates) {
+    put(out, name);
+  }
+  putCells(out, m.compiled_defs);
+  put(out, (cell)m.generated.size());
+  for (auto& g : m.generated) {
+    put(out, (cell)g.first);
+    put(out, (cell)g.second.size());
+    for (auto& op : g.second) {
+      put(out, (cell)op.run_token);
+      put(out, op.value);
+    }
+  }
+  put(out, (cell)m.bound.size());
+  for (auto& b : m.bound) {
+    put(out, (cell)b.first);
+    put(out, b.second);
+  }
+  putInput(out, m);
+  if (!putPreload(out, m, opts.preload)) {
+    return false;
+  }
+  put(out, (cell)m.data_space.size());
+  out.write(m.data_space.data(), m.data_space.size());
+  put(out, m.next_region_base);
+  put(out, (cell)output.written);
+  return (bool)out.flush();
 }
 
-void interpString(machine_state& m, const char *start, const char *end)
+/*
+ * Reads the program text and the options it was compiled with. core is set
+ * if the file is a core file rather than a snapshot.
+ */
+bool readSnapshotProgram(
+  std::istream& in, options& opts, std::string& text, bool& core)
 {
-  m.push(0);
-  for (auto it = end - 2; it != start; --it)
-  {
-    if (*it == '\\') {
-      int c;
-      if (m.pop(c)) {
-        switch(c) {
-        case 'n': m.push('\n'); break;
-        case 'r': m.push('\r'); break;
-        case '"': m.push('"'); break;
-        case '\\': m.push('\\'); break;
-        case 't': m.push('\t'); break;
-        default: break;
-        }
-      } else {
-        m.push('\\');
-      }
-    } else {
-      m.push((int)*it);
-    }
+  char magic[sizeof(snapshot_magic)];
+  if (!in.read(magic, sizeof(magic))) {
+    return false;
   }
+  core = !memcmp(magic, core_magic, sizeof(magic));
+  return (core || !memcmp(magic, snapshot_magic, sizeof(magic))) &&
+         get(in, opts.opt_level) && get(in, opts.fold_fuel) &&
+         get(in, opts.preload) && get(in, opts.input) && get(in, text);
 }
 
-lex_fn token_table[] {
-  lexRegex(
-    tokens::comment,
-    R"(\([^\)]*\))"
-  ),
-  lexChar(
-    tokens::start_definition,
-    ':',
-    [](machine_state& m, const token& tok)
-    {
-      m.next();
-      if (m.atEnd() || m.curr_token->kind != tokens::identifier) {
-        m.error() << "expecting identifier";
-      }
-      std::string id { m.curr_token->start, m.curr_token->end };
-      m.next();
-      auto start = m.curr_token;
-
-      while (!m.atEnd() && m.curr_token->kind != tokens::end_definition) {
-        m.next();
+/*
+ * Reads the rest of a snapshot into a machine built from its program. When
+ * resume_output is set, output carries on from where the snapshot left it.
+ */
+bool readSnapshotState(
+  std::istream& in, machine_state& m, bool resume_output = true)
+{
+  cell ip, n, a, b, written;
+  std::string name;
+  if (!get(in, ip) || ip < 0 || ip > m.end_addr() ||
+      !getCells(in, m.dstack) || !getCells(in, m.rstack) || !get(in, n)) {
+    return false;
+  }
+  m.wordlists.assign(n, hash_table { 0 });
+  for (auto& words : m.wordlists) {
+    if (!get(in, n)) return false;
+    while (n--) {
+      if (!get(in, name) || !get(in, a) || a < 0 || a > m.end_addr()) {
+        return false;
       }
+      words.insert(m.intern(name), a);
+    }
+  }
+  if (m.wordlists.empty() || !getCells(in, m.search_order) ||
+      !get(in, m.current) || m.current < 0 ||
+      m.current >= (cell)m.wordlists.size() ||
+      !getAddrs(in, m, m.labels) || !get(in, n)) {
+    return false;
+  }
+  for (auto wid : m.search_order) {
+    if (wid < 0 || wid >= (cell)m.wordlists.size()) return false;
+  }
+  std::map<std::string, std::pair<cell, cell>> tables;
+  while (n--) {
+    if (!get(in, name) || !get(in, a) || !get(in, b)) return false;
+    tables[name] = std::make_pair(a, b);
+  }
 
-      if (m.curr_token->kind != tokens::end_definition) {
-        m.error() << "expecting ':'";
-      }
+  // Map each table's cells where they were by running its token again.
+  if (!get(in, n)) return false;
+  while (n--) {
+    if (!get(in, a) || !get(in, b)) return false;
+    auto tok = std::find_if(m.token_stream.begin(), m.token_stream.end(),
+      [&](const token& t) {
+        return t.kind == tokens::table && t.start == m.text_begin + a;
+      });
+    if (tok == m.token_stream.end()) return false;
+    m.next_region_base = b;
+    m.curr_token = tok;
+    tok->interpret(m, *tok);
+  }
+  m.tables = std::move(tables);
 
-      m.next();
-      m.dictionary[id] = start;
-    }
-  ),
-  lexChar(
-    tokens::end_definition,
-    ';',
-    [](machine_state& m, const token& tok)
-    {
-      m.exit();
+  if (!get(in, n)) return false;
+  while (n--) {
+    if (!get(in, name)) return false;
+    loadExtensionFile(m, name);
+  }
+  if (!get(in, n)) return false;
+  std::map<cell, std::string> xts;
+  while (n--) {
+    if (!get(in, name) || !get(in, a) ||
+        (!intrinsics.count(name) && !operations.count(name))) {
+      return false;
     }
-  ),
-  lexRegex(
-    tokens::label,
-    R"(\[[^\s]+\])",
-    [](machine_state& m, const token& tok)
-    {
-      m.next();
-      m.labels[std::string { tok.start + 1, tok.end - 1 }] = m.curr_token;
+    xts[-a] = name;
+  }
+  for (auto& x : xts) {
+    m.xt(x.second);
+  }
+
+  if (!get(in, n)) return false;
+  while (n--) {
+    std::unique_ptr<hash_table> t { new hash_table { 0 } };
+    if (!get(in, a) || !get(in, b) || !getCells(in, t->data) ||
+        t->data.size() < hash_table::header_cells) {
+      return false;
     }
-  ),
-  lexRegex(
-    tokens::print,
-    R"(\.([cds]|"[^"]*")?)",
-    [](machine_state& m, const token& tok)
-    {
-      if ((tok.end - tok.start) > 1) {
-        if (*(tok.start + 1) == '"') {
-          interpString(m, tok.start + 1, tok.end);
-        } else if (*(tok.start + 1) == 'd') {
-          m.debug(std::cout);
-          m.next();
-          return;
-        } else if (*(tok.start + 1) == 'c') {
-          std::cout << (char)m.pop() << std::flush;
-          m.next();
-          return;
-        }
-        while (true) {
-          int c;
-          if (m.pop(c)) {
-            if (c == 0) {
-              break;
-            } else {
-              std::cout << (char)c;
-            }
-          } else {
-            m.error() << "no null terminator found before end of stack reached";
-          }
-        }
-      } else {
-        std::cout << m.pop() << std::endl;
-      }
-      m.next();
+    t->tombstones = b;
+    m.regions.push_back(memory_region {
+      a, (cell)(t->data.size() * sizeof(cell)), (char*)t->data.data(), false
+    });
+    m.hash_tables[a] = std::move(t);
+  }
+
+  if (!get(in, n)) return false;
+  m.bignums.resize(n);
+  for (auto& big : m.bignums) {
+    if (!get(in, a)) return false;
+    if (a) {
+      big.reset(new bignum);
+      big->negative = a == 2;
+      if (!getCells(in, big->mag)) return false;
     }
-  ),
-  lexRegex(
-    tokens::number,
-    R"((-)?(0[xX][0-9a-fA-F]+|0[0-7]*|[1-9][0-9]*))",
-    [](machine_state& m, const token& tok)
-    {
-      m.push(strtol(tok.start, nullptr, 0));
-      m.next();
+  }
+
+  // Compiled words run the code generated for them again.
+  if (!get(in, m.last_defined) || !get(in, n)) return false;
+  while (n--) {
+    if (!get(in, name)) return false;
+    m.immediates.insert(name);
+  }
+  std::vector<cell> defs;
+  if (!getCells(in, defs) || !get(in, n)) return false;
+  m.compiled_defs.insert(defs.begin(), defs.end());
+  while (n--) {
+    if (!get(in, a) || a < 0 || a >= m.end_addr() || !get(in, b)) {
+      return false;
     }
-  ),
-  lexRegex(
-    tokens::string,
-    R"("[^"]*")",
-    [](machine_state& m, const token& tok)
-    {
-      interpString(m, tok.start, tok.end);
-      m.next();
+    auto& ops = m.generated[a];
+    while (b--) {
+      cell run_token, value;
+      if (!get(in, run_token) || !get(in, value)) return false;
+      ops.push_back(generated_op { run_token != 0, value });
     }
-  ),
-  lexRegex(
-    tokens::identifier,
-    R"([^\s]+)",
-    [](machine_state& m, const token& tok)
-    {
-      if (isOperation(tok.start, tok.end)) {
-        interpOperation(m, tok);
-        return;
-      }
-      auto it = m.dictionary.find(tok.to_string());
-      if (it == m.dictionary.end()) {
-        if (m.intrinsic(tok.to_string())) {
-          return;
-        }
-        m.error() << "no word named " << tok.to_string() << " in dictionary.";
-      }
-
-      m.next();
-      m.rpush();
-      m.curr_token = it->second;
+    m.patch_site(a);
+  }
+  if (!get(in, n)) return false;
+  while (n--) {
+    if (!get(in, a) || a < 0 || a >= m.end_addr() || !get(in, b) ||
+        b >= m.end_addr() || -b > (cell)m.intrinsic_xts.size()) {
+      return false;
     }
-  ),
-};
-static_assert(sizeof(token_table) / sizeof(lex_fn) == num_token_kinds);
+    m.bind(a, b);
+  }
 
-const char *skipWs(const char *c, const char *end)
-{
-  while (c && c != end && std::isspace(*c)) { ++c; }
-  return c;
-}
+  if (!getInput(in, m) || !getPreload(in, m) ||
+      !get(in, n) || n < (cell)sizeof(cell) || n > machine_state::max_data_space) {
+    return false;
+  }
+  m.data_space.resize(n);
+  if (!in.read(m.data_space.data(), n) ||
+      !get(in, m.next_region_base) || !get(in, written)) {
+    return false;
+  }
+  m.abranch(ip);
+  if (!resume_output) {
+    return true;
+  }
 
-token_opt lexToken(const char *input, const char *end)
-{
-  for (auto fn : token_table)
-  {
-    token_opt t;
-    if ((t = fn(input, end))) {
-      return t;
-    }
+  // Carry on after the output printed before the snapshot, if that output is
+  // still there.
+  struct stat st;
+  if (fstat(output.fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      st.st_size >= written && ftruncate(output.fd, written) == 0) {
+    lseek(output.fd, written, SEEK_SET);
   }
-  return { };
+  output.written = written;
+  return true;
 }
 
-std::vector<token> lexTokens(const char *input, const char *end)
+/*
+ * Like machine_state::run(), but every opts.checkpoint_ns nanoseconds forks
+ * a child process that writes a snapshot of the machine, so the program
+ * only pauses for the fork. A snapshot is written to a temporary file and
+ * renamed once complete, and none is started while the last one is still
+ * being written.
+ */
+int runWithCheckpoints(
+  machine_state& m, const std::string& text, const options& opts)
 {
-  std::vector<token> tokens;
-  for (const char *it = skipWs(input, end); it != end; it = skipWs(it, end))
-  {
-    auto t = lexToken(it, end);
-    if (!t) {
-      const char *tokEnd = it;
-      while (tokEnd != end && !std::isspace(*tokEnd)) ++tokEnd;
-      std::cerr << "error at position " << (std::ptrdiff_t)(it - input)
-                << ": unrecognized token " << std::string { it, tokEnd }
+  auto due = nowNs() + opts.checkpoint_ns;
+  pid_t writer = 0;
+  while (!m.atEnd()) {
+    for (int i = 0; i < 4096 && !m.atEnd(); ++i) {
+      m.curr_token->interpret(m, *m.curr_token);
+    }
+    if (m.atEnd() || nowNs() < due) {
+      continue;
+    }
+    if (writer && waitpid(writer, nullptr, WNOHANG) == 0) {
+      continue;
+    }
+    output.flush();
+    writer = fork();
+    if (writer == 0) {
+      auto tmp = opts.checkpoint_file + ".tmp";
+      std::ofstream out { tmp, std::ios::binary | std::ios::trunc };
+      _exit(writeSnapshot(out, m, text, opts) &&
+            rename(tmp.c_str(), opts.checkpoint_file.c_str()) == 0 ? 0 : 1);
+    } else if (writer < 0) {
+      std::cerr << "couldn't start a checkpoint: " << strerror(errno)
                 << std::endl;
-      exit(1);
+      writer = 0;
     }
-    tokens.push_back(*t);
-    it = t->end;
+    due = nowNs() + opts.checkpoint_ns;
   }
-  return tokens;
+  if (writer) {
+    waitpid(writer, nullptr, 0);
+  }
+  return m.exit_code();
 }
 
 void readFile(std::istream& is, std::string& out)
@@ -857,17 +6036,98 @@ void readFile(std::istream& is, std::string& out)
   out += ss.str();
 }
 
+/*
+ * Sets up and runs a loaded program as the options say, returning its exit
+ * code. snapshot is the open snapshot or core file being restored, if any.
+ */
+int runProgram(
+  machine_state& m, std::istream& snapshot, const std::string& text,
+  const options& opts)
+{
+  auto viewing = !opts.view_core.empty();
+  if (!opts.preload.empty()) {
+    cell len;
+    if (!isLittleEndian() ||
+        m.map_file(opts.preload, true, m.preload_addr, len) != ior_ok) {
+      std::cerr << "couldn't preload file " << opts.preload << std::endl;
+      exit(1);
+    }
+    m.preload_cells = len / sizeof(cell);
+  }
+  if (!opts.input.empty()) {
+    m.input_fd = open(opts.input.c_str(), O_RDONLY);
+    if (m.input_fd < 0) {
+      std::cerr << "couldn't open file " << opts.input << std::endl;
+      exit(1);
+    }
+  }
+  if (!opts.restore.empty() && !readSnapshotState(snapshot, m, !viewing)) {
+    std::cerr << "couldn't restore snapshot " << opts.restore << std::endl;
+    exit(1);
+  }
+  m.dump_window = opts.dump_window;
+  m.dump_cells = opts.dump_cells;
+  m.sort_threads = opts.sort_threads;
+  m.parallel_sort_min = opts.parallel_sort_min;
+  if (viewing) {
+    m.dump_window = m.dump_cells = -1;
+    std::stringstream ss;
+    m.debug(ss);
+    output.write(ss.str());
+    return 0;
+  }
+  if (!opts.core_dump.empty()) {
+    m.core_dump = [&](const machine_state& m) {
+      std::ofstream out { opts.core_dump, std::ios::binary | std::ios::trunc };
+      if (writeSnapshot(out, m, text, opts, true)) {
+        std::cerr << "core dumped to " << opts.core_dump << std::endl;
+      } else {
+        std::cerr << "couldn't write core dump " << opts.core_dump
+                  << std::endl;
+      }
+    };
+  }
+
+  if (opts.checkpoint_ns) {
+    return runWithCheckpoints(m, text, opts);
+  }
+  return m.run();
+}
+
 int main(int argc, char *const argv[])
 {
+  auto opts = parseOptions(argc, argv);
+  registerNativeWords();
+  auto& cpu = cpuFeatures();
+  if (opts.verbose) {
+    std::cerr << "cpu features:" << (cpu.sse42 ? " sse4.2" : "")
+              << (cpu.avx2 ? " avx2" : "") << std::endl;
+  }
   std::string text;
-  if (argc > 1) {
-    for (int n = 1; n < argc; ++n) {
-      if (std::string { argv[n]} == "-") {
+  std::ifstream snapshot;
+  if (!opts.view_core.empty()) {
+    opts.restore = opts.view_core;
+  }
+  if (!opts.restore.empty()) {
+    snapshot.open(opts.restore, std::ios::binary);
+    bool core;
+    if (!readSnapshotProgram(snapshot, opts, text, core)) {
+      std::cerr << "couldn't read snapshot " << opts.restore << std::endl;
+      exit(1);
+    }
+    if (core && opts.view_core.empty()) {
+      std::cerr << opts.restore << " is a core file, which can only be "
+                << "viewed with --view-core" << std::endl;
+      exit(1);
+    }
+  } else if (!opts.files.empty()) {
+    for (auto& file : opts.files) {
+      if (file == "-") {
         readFile(std::cin, text);
       } else {
-        auto is = std::ifstream { argv[n], std::ios::binary };
+        auto is = std::ifstream { file, std::ios::binary };
         if (!is) {
-          std::cerr << "couldn't open file " << argv[n] << std::endl;
+          std::cerr << "couldn't open file " << file << std::endl;
           exit(1);
         }
         readFile(is, text);
@@ -876,8 +6136,34 @@ int main(int argc, char *const argv[])
   } else {
     text = forth;
   }
-  machine_state m {
-    lexTokens(text.data(), text.data() + text.size())
-  };
-  return m.run();
+  auto load_start = nowNs();
+  arena program;
+  auto tokens = lexTokens(text.data(), text.data() + text.size(), program);
+  checkBrackets(tokens);
+  if (opts.opt_level > 0) {
+    auto folded = foldPureCalls(tokens, opts.fold_fuel);
+    auto vectorized = vectorizeLoops(tokens);
+    if (opts.verbose) {
+      std::cerr << "folded " << folded << " pure call sites\n"
+                << "vectorized " << vectorized << " loops" << std::endl;
+    }
+  }
+  int code;
+  cell teardown_start;
+  {
+    machine_state m { std::move(tokens) };
+    if (opts.verbose) {
+      std::cerr << "loaded " << m.end_addr() << " tokens in "
+                << (nowNs() - load_start) / 1000000 << " ms, "
+                << program.bytes_allocated() / 1024 << " KiB in the arena"
+                << std::endl;
+    }
+    code = runProgram(m, snapshot, text, opts);
+    teardown_start = nowNs();
+  }
+  if (opts.verbose) {
+    std::cerr << "tore down in " << (nowNs() - teardown_start) / 1000000
+              << " ms" << std::endl;
+  }
+  return code;
 }